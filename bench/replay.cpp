@@ -0,0 +1,234 @@
+// Replays keystroke sessions against the TUI (psv::Interface, the same components
+// math_matters runs) on an offscreen screen and reports how long each keystroke
+// takes: handling the event, which is where statements get evaluated, and then
+// rendering the frame that follows it.
+//
+//     replay_bench                               the built-in sessions
+//     math_matters --record typing.session       record one
+//     replay_bench -s typing.session -n 50       replay it 50 times
+//     replay_bench --max-p99 2000                fail when any session's p99 is over 2 ms
+//     replay_bench --store bench.store           with statements coming back from a store
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <spdlog/spdlog.h>
+#include "spdlog/sinks/basic_file_sink.h"
+#include "spdlog/sinks/null_sink.h"
+#include "ftxui/component/component.hpp"
+#include "ftxui/component/event.hpp"
+#include "ftxui/screen/screen.hpp"
+#include "Interface.h"
+#include "ResultStore.h"
+
+struct Session {
+    std::string name;
+    std::vector<ftxui::Event> events;
+};
+
+// Keystrokes for typing text; '\n' is Return
+static void type(std::vector<ftxui::Event>& events, const std::string& text) {
+    for (char c : text) {
+        events.push_back(c == '\n' ? ftxui::Event::Return : ftxui::Event::Character(c));
+    }
+}
+
+static void press(std::vector<ftxui::Event>& events, const ftxui::Event& key, int times = 1) {
+    events.insert(events.end(), times, key);
+}
+
+// Focus starts on the tab menu, so each session first moves down into its tab
+static std::vector<Session> builtinSessions() {
+    using ftxui::Event;
+    std::vector<Session> sessions;
+
+    Session short_statements{"short statements", {}};
+    press(short_statements.events, Event::ArrowDown);
+    type(short_statements.events, "2*(3+4)^2 - 10/5\n");
+    press(short_statements.events, Event::Backspace, 16);
+    type(short_statements.events, "sqrt(16) + max(1, 2) * -3\n");
+    sessions.push_back(short_statements);
+
+    // Every keystroke re-evaluates the whole statement and its steps
+    Session long_statement{"long statement", {}};
+    press(long_statement.events, Event::ArrowDown);
+    std::string statement = "1";
+    for (int i = 2; statement.size() < 240; i++) {
+        statement += i % 4 == 0 ? "+(" + std::to_string(i) + "-1)*2" : i % 4 == 1 ? "-" + std::to_string(i) + "/4"
+                   : i % 4 == 2 ? "*1.5" : "+" + std::to_string(i) + "^2";
+    }
+    type(long_statement.events, statement + "\n");
+    press(long_statement.events, Event::PageDown, 4);
+    press(long_statement.events, Event::PageUp, 2);
+    press(long_statement.events, Event::Backspace, 20);
+    sessions.push_back(long_statement);
+
+    Session errors{"errors", {}};
+    press(errors.events, Event::ArrowDown);
+    type(errors.events, "((1+2)*3 - 4/(2-2)");
+    press(errors.events, Event::Backspace, 6);
+    type(errors.events, "max(1) + 9^9^9^9");
+    sessions.push_back(errors);
+
+    Session definitions{"definitions", {}};
+    press(definitions.events, Event::ArrowRight);
+    press(definitions.events, Event::ArrowDown);
+    type(definitions.events, "a = 3*4\nb = a^2 - 1\nc = b/a + sqrt(a)\nd = c*c - b\n");
+    press(definitions.events, Event::ArrowUp, 4);
+    type(definitions.events, "1");
+    sessions.push_back(definitions);
+
+    return sessions;
+}
+
+struct Percentiles {
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+// Nanoseconds in, microseconds out
+static Percentiles percentiles(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) {
+        return samples[std::min(samples.size() - 1, static_cast<std::size_t>(q * samples.size()))] / 1000;
+    };
+    double total = 0;
+    for (double sample : samples)
+        total += sample;
+    return {total / samples.size() / 1000, at(0.5), at(0.9), at(0.99), samples.back() / 1000};
+}
+
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Show this message")
+        ("session,s", po::value<std::vector<std::string>>(), "A recorded session (math_matters --record); "
+                                                             "the built-in ones when there are none")
+        ("repeat,n", po::value<int>()->default_value(20), "Times to replay each session")
+        ("warmup", po::value<int>()->default_value(2), "Replays to run first and not count")
+        ("width", po::value<int>()->default_value(120), "Columns of the offscreen screen")
+        ("height", po::value<int>()->default_value(40), "Rows of the offscreen screen")
+        ("max-p99", po::value<double>(), "Exit with failure when a session's p99 keystroke takes longer (us)")
+        ("store", po::value<std::string>(), "Use this result store, as math_matters does by default; "
+                                            "each statement is evaluated only the first time")
+        ("log", "Log to basic-log.txt and step-log.txt like math_matters does, instead of nowhere")
+        ("show", "Print each session's last frame");
+    po::variables_map args;
+    try {
+        po::store(po::parse_command_line(argc, argv, options), args);
+        po::notify(args);
+    } catch (po::error& e) {
+        std::cerr << e.what() << '\n' << options;
+        return EXIT_FAILURE;
+    }
+    if (args.count("help")) {
+        std::cout << options;
+        return EXIT_SUCCESS;
+    }
+
+    if (args.count("log")) {
+        spdlog::basic_logger_mt("basic_logger", "basic-log.txt");
+        spdlog::basic_logger_mt("step_logger", "step-log.txt");
+    } else {
+        spdlog::null_logger_mt("basic_logger");
+        spdlog::null_logger_mt("step_logger");
+    }
+
+    std::vector<Session> sessions;
+    if (args.count("session")) {
+        for (auto const& path : args["session"].as<std::vector<std::string>>()) {
+            std::ifstream file(path);
+            if (!file) {
+                std::cerr << "Could not open " << path << std::endl;
+                return EXIT_FAILURE;
+            }
+            sessions.push_back({path, psv::readSession(file)});
+        }
+    } else {
+        sessions = builtinSessions();
+    }
+
+    std::unique_ptr<psv::ResultStore> store;
+    if (args.count("store")) {
+        try {
+            store = std::make_unique<psv::ResultStore>(args["store"].as<std::string>());
+        } catch (const std::system_error& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const int width = args["width"].as<int>();
+    const int height = args["height"].as<int>();
+    const int warmup = std::max(0, args["warmup"].as<int>());
+    const int repeat = std::max(1, args["repeat"].as<int>());
+    bool too_slow = false;
+
+    std::cout << std::left << std::setw(20) << "session" << std::right << std::setw(7) << "keys" << "  "
+              << std::left << std::setw(8) << "stage" << std::right;
+    for (const char* column : {"mean", "p50", "p90", "p99", "max"})
+        std::cout << std::setw(10) << column;
+    std::cout << "   (us per keystroke)\n";
+
+    for (auto const& session : sessions) {
+        if (session.events.empty())
+            continue;
+        std::vector<double> event_ns;
+        std::vector<double> render_ns;
+        std::vector<double> total_ns;
+        std::string frame;
+        for (int run = 0; run < warmup + repeat; run++) {
+            // A fresh UI each time, as if the app had just started
+            psv::Interface interface([height] { return height; }, store.get());
+            ftxui::Component root = interface.component();
+            auto screen = ftxui::Screen::Create(ftxui::Dimension::Fixed(width), ftxui::Dimension::Fixed(height));
+            for (auto const& event : session.events) {
+                auto start = std::chrono::steady_clock::now();
+                root->OnEvent(event);
+                auto handled = std::chrono::steady_clock::now();
+                // What ScreenInteractive does for a frame, short of writing it out
+                screen.Clear();
+                ftxui::Render(screen, root->Render());
+                frame = screen.ToString();
+                auto rendered = std::chrono::steady_clock::now();
+                if (run < warmup)
+                    continue;
+                event_ns.push_back(std::chrono::duration<double, std::nano>(handled - start).count());
+                render_ns.push_back(std::chrono::duration<double, std::nano>(rendered - handled).count());
+                total_ns.push_back(std::chrono::duration<double, std::nano>(rendered - start).count());
+            }
+        }
+
+        const std::pair<const char*, const std::vector<double>*> stages[] = {
+            {"event", &event_ns}, {"render", &render_ns}, {"total", &total_ns},
+        };
+        for (std::size_t i = 0; i < std::size(stages); i++) {
+            Percentiles p = percentiles(*stages[i].second);
+            std::cout << std::left << std::setw(20) << (i == 0 ? session.name : "") << std::right << std::setw(7)
+                      << (i == 0 ? std::to_string(session.events.size()) : "") << "  "
+                      << std::left << std::setw(8) << stages[i].first << std::right << std::fixed << std::setprecision(1);
+            for (double value : {p.mean, p.p50, p.p90, p.p99, p.max})
+                std::cout << std::setw(10) << value;
+            std::cout << '\n';
+            if (stages[i].second == &total_ns && args.count("max-p99") && p.p99 > args["max-p99"].as<double>()) {
+                std::cerr << session.name << ": p99 of " << p.p99 << " us is over the limit" << std::endl;
+                too_slow = true;
+            }
+        }
+        if (args.count("show"))
+            std::cout << frame << '\n';
+    }
+    return too_slow ? EXIT_FAILURE : EXIT_SUCCESS;
+}
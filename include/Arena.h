@@ -0,0 +1,52 @@
+#ifndef MATH_MATTERS_ARENA_H
+#define MATH_MATTERS_ARENA_H
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace psv
+{
+
+// Bump allocator for data that lives exactly as long as one evaluation.
+// Nothing is freed individually; reset() rewinds everything at once and keeps the
+// memory, so after the first few evaluations it stops calling malloc at all.
+class Arena {
+public:
+    explicit Arena(std::size_t block_size = 4096, std::size_t max_retained = 1 << 20);
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t));
+
+    // Copy text into the arena; the view is valid until the next reset()
+    std::string_view copy(std::string_view text);
+
+    // Rewind to empty. If the last round spilled into several blocks they are merged
+    // into one big enough for all of it (up to max_retained).
+    void reset();
+
+    // Query
+    std::size_t used() const;
+    std::size_t capacity() const;
+    std::size_t blocks() const;
+
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size;
+    };
+
+    void addBlock(std::size_t size);
+
+    std::vector<Block> _blocks;
+    std::size_t _current;
+    std::size_t _offset;
+    std::size_t _used;
+    std::size_t _block_size;
+    std::size_t _max_retained;
+};
+
+} // namespace psv
+
+#endif //MATH_MATTERS_ARENA_H
@@ -0,0 +1,91 @@
+#ifndef MATH_MATTERS_BATCH_COMPILER_H
+#define MATH_MATTERS_BATCH_COMPILER_H
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "MathProcessor.h"
+#include "Stack.h"
+
+namespace psv
+{
+
+// Compiles a batch of statements into one hash-consed DAG: every distinct
+// sub-expression (same operator, same operands) is a single node no matter how
+// many statements contain it, and evaluate() computes each node exactly once.
+// Nodes are evaluated level by level so every '^' on a level goes through
+// powColumn() together, and every call of a function through functionColumn().
+//
+//     BatchCompiler batch;
+//     batch.add("(1+2)*3");
+//     batch.add("4-(1+2)");      // reuses the 1, 2 and 1+2 nodes
+//     std::vector<Result<float>> results = batch.evaluate();
+class BatchCompiler {
+public:
+    // Parse eq into the DAG and return its index in the batch.
+    // A statement that fails to parse keeps its Error for evaluate() to hand back,
+    // unless a division reduced before it fails first, as it would in evaluate().
+    std::size_t add(const equation &eq);
+
+    std::vector<Result<float>> evaluate() const;
+
+    void clear();
+
+    // Query
+    std::size_t size() const;
+    std::size_t nodeCount() const;
+    // Nodes the statements asked for, before sharing
+    std::size_t referenceCount() const;
+    // referenceCount() - nodeCount()
+    std::size_t deduplicated() const;
+
+private:
+    using NodeId = std::uint32_t;
+
+    struct Node {
+        char op;      // '#' constant (lhs holds the float's bits), 'n' negation, a function's
+                      // opcode (arguments in lhs and rhs), else binary
+        NodeId lhs;
+        NodeId rhs;
+
+        bool operator==(const Node &other) const = default;
+    };
+
+    struct NodeHash {
+        std::size_t operator()(const Node &node) const;
+    };
+
+    // Where a statement divides, so a zero division can be reported at the right '/'
+    // (or mod)
+    struct Division {
+        NodeId node;
+        std::size_t offset;
+    };
+
+    struct Statement {
+        Error error;
+        NodeId root;
+        std::size_t divisions_begin;
+        std::size_t divisions_end;
+    };
+
+    NodeId intern(char op, NodeId lhs, NodeId rhs);
+    Result<NodeId> parse();
+    Error reduce(Stack<NodeId> &output, Stack<Operator> &operators);
+
+    std::vector<Node> _nodes;
+    // longest path down to a constant; nodes on the same level are independent
+    std::vector<std::uint32_t> _levels;
+    std::unordered_map<Node, NodeId, NodeHash> _interned;
+    std::vector<Statement> _statements;
+    std::vector<Division> _divisions;
+    std::size_t _references = 0;
+
+    // scratch for add(), kept to reuse the allocations
+    equation _normalized;
+    std::vector<std::size_t> _origin;
+};
+
+} // namespace psv
+
+#endif //MATH_MATTERS_BATCH_COMPILER_H
@@ -0,0 +1,92 @@
+#ifndef MATH_MATTERS_BUDGET_H
+#define MATH_MATTERS_BUDGET_H
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include "Result.h"
+
+namespace psv
+{
+
+// Lets another thread stop an evaluation. The evaluation notices at its next
+// reduction and returns ErrorCode::BudgetExceeded (with Limit::Cancelled).
+class CancellationToken {
+public:
+    void cancel() { _cancelled.store(true, std::memory_order_relaxed); }
+    void reset() { _cancelled.store(false, std::memory_order_relaxed); }
+    bool cancelled() const { return _cancelled.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> _cancelled{false};
+};
+
+// What one evaluation may use up. Zero means no limit, which is the default.
+struct Budget {
+    // numbers, operators and parentheses
+    std::size_t max_tokens = 0;
+    // parentheses inside parentheses
+    std::size_t max_depth = 0;
+    // operators applied, i.e. steps
+    std::size_t max_reductions = 0;
+    // bytes of steps recorded; each step is the whole statement, so for a long one
+    // they grow with the square of its length long before reductions run out
+    std::size_t max_step_bytes = 0;
+    // from the start of the evaluation
+    std::chrono::steady_clock::duration timeout{0};
+    // largest magnitude a '^' may produce (so std::numeric_limits<float>::max()
+    // turns an overflowing power into an error instead of inf)
+    float max_magnitude = 0;
+    const CancellationToken *cancellation = nullptr;
+};
+
+enum class Limit : unsigned char {
+    None = 0,
+    Tokens,
+    Depth,
+    Reductions,
+    Deadline,
+    Magnitude,
+    Cancelled,
+    StepBytes,
+};
+
+const char *limitName(Limit limit);
+
+// Keeps track of one evaluation against its Budget. The checks are a few loads and
+// compares (plus reading the clock when there's a timeout), cheap enough for every
+// reduction; threads sharing an evaluation can share a Meter and charge it in batches.
+// Once any limit trips, every later check reports it too.
+class Meter {
+public:
+    // Reset the counters; the timeout runs from here
+    void start(const Budget &budget);
+
+    // Tokens and depth, before evaluating anything. Offsets are into normalized.
+    Error measure(const std::string &normalized);
+
+    // Count reductions, then check them, the clock and the cancellation token
+    Limit charge(std::size_t reductions = 1);
+
+    // The result of a '^'
+    Limit checkMagnitude(float value);
+
+    // Count the bytes of a step about to be recorded
+    Limit chargeStep(std::size_t bytes);
+
+    Limit exceeded() const;
+
+private:
+    Limit trip(Limit limit);
+
+    Budget _budget;
+    std::chrono::steady_clock::time_point _deadline;
+    std::atomic<std::size_t> _reductions{0};
+    // only evaluations with steps, which are never shared, record any
+    std::size_t _step_bytes = 0;
+    std::atomic<Limit> _exceeded{Limit::None};
+};
+
+} // namespace psv
+
+#endif //MATH_MATTERS_BUDGET_H
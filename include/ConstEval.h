@@ -0,0 +1,166 @@
+#ifndef MATH_MATTERS_CONST_EVAL_H
+#define MATH_MATTERS_CONST_EVAL_H
+#include <cstddef>
+#include <string_view>
+#include <stdexcept>
+#include "MathProcessor.h"
+
+// Compile-time evaluation of constant statements:
+//
+//     constexpr float x = psv::ct_eval("2^10-3*4");   // 1012
+//
+//     using namespace psv::literals;
+//     constexpr float y = "2^10-3*4"_eval;
+//
+// An invalid statement is a compile error (the throw below isn't a constant expression).
+// Preparing, validating and the shunting-yard loop are MathProcessor.h's, the same
+// ones evaluate() runs, so the grammar and errors are its too; there just aren't any steps.
+
+namespace psv
+{
+
+// Stack with inline storage so it can live in a constant expression.
+// Capacity has to cover the whole statement; nothing here checks it.
+template<typename T, std::size_t Capacity>
+class FixedStack {
+public:
+    constexpr void place(T element) { _stack[_size++] = element; }
+    constexpr T pop() { return _stack[--_size]; }
+    constexpr T top() const { return _stack[_size - 1]; }
+    constexpr bool isEmpty() const { return _size == 0; }
+    constexpr std::size_t size() const { return _size; }
+
+private:
+    T _stack[Capacity]{};
+    std::size_t _size = 0;
+};
+
+namespace ct
+{
+    constexpr Result<float> parseNumber(std::string_view number, std::size_t offset) {
+        double value = 0;
+        double scale = 1;
+        bool seen_point = false;
+        for (char c : number) {
+            if (c == '.') {
+                if (seen_point)
+                    return Error{ErrorCode::InvalidNumber, offset, number.size()};
+                seen_point = true;
+            } else {
+                value = value * 10 + (c - '0');
+                if (seen_point)
+                    scale *= 10;
+            }
+        }
+        if (number == ".")
+            return Error{ErrorCode::InvalidNumber, offset, number.size()};
+        return static_cast<float>(value / scale);
+    }
+
+    // cycleStack() from MathProcessor.cpp, minus the steps
+    template<std::size_t Capacity>
+    constexpr Error cycleStack(FixedStack<float, Capacity> &output, FixedStack<Operator, Capacity> &operators) {
+        Operator op = operators.pop();
+        if (isFunction(op.symbol)) {
+            const unsigned arity = functionInfo(op.symbol).arity;
+            if (output.size() < arity)
+                return {ErrorCode::InvalidCall, op.offset, 1};
+            float args[max_arity]{};
+            for (unsigned i = arity; i-- > 0;)
+                args[i] = output.pop();
+            Result<float> value = applyFunction(op.symbol, args);
+            if (!value)
+                return {value.error().code, op.offset, 1};
+            output.place(*value);
+            return {};
+        }
+        if (output.isEmpty())
+            return {ErrorCode::InvalidOperator, op.offset, 1};
+        float b = output.pop();
+        if (isUnary(op.symbol)) {
+            output.place(b * -1);
+            return {};
+        }
+        if (output.isEmpty())
+            return {ErrorCode::InvalidOperator, op.offset, 1};
+        float a = output.pop();
+        Result<float> value = operateBinary(a, b, op.symbol);
+        if (!value)
+            return {value.error().code, op.offset, 1};
+        output.place(*value);
+        return {};
+    }
+
+    template<std::size_t Capacity>
+    constexpr Result<float> shuntingYard(std::string_view eq) {
+        FixedStack<float, Capacity> output;
+        FixedStack<Operator, Capacity> operators;
+        const Error err = runShuntingYard(eq, operators,
+            [&](std::size_t offset, std::size_t length) {
+                Result<float> number = parseNumber(eq.substr(offset, length), offset);
+                if (!number)
+                    return number.error();
+                output.place(*number);
+                return Error{};
+            },
+            [&] { return cycleStack(output, operators); });
+        if (err)
+            return err;
+        if (output.size() != 1)
+            return Error{ErrorCode::EmptyExpression, 0, eq.size()};
+        return output.pop();
+    }
+} // namespace ct
+
+// evaluate(), minus the steps, for statements of at most Capacity characters
+template<std::size_t Capacity>
+constexpr Result<float> constEvaluate(std::string_view eq) {
+    if (eq.size() > Capacity)
+        return Error{ErrorCode::TooLong, Capacity, eq.size() - Capacity};
+
+    char normalized[Capacity + 1]{};
+    std::size_t origin[Capacity + 1]{};
+    std::size_t length = stripWhiteSpace(eq, normalized, origin);
+    if (length == 0)
+        return Error{ErrorCode::EmptyExpression, 0, eq.size()};
+
+    // prepare()'s own validation
+    if (Error err = validateNormalized(normalized, origin, length))
+        return locate(err, origin, length, eq.size());
+
+    Result<float> result = ct::shuntingYard<Capacity>(std::string_view(normalized, length));
+    if (!result)
+        return locate(result.error(), origin, length, eq.size());
+    return result;
+}
+
+template<std::size_t N>
+consteval float ct_eval(const char (&eq)[N]) {
+    Result<float> result = constEvaluate<N>(std::string_view(eq, N - 1));
+    if (!result)
+        throw std::invalid_argument(errorMessage(result.error().code));
+    return *result;
+}
+
+// Lets a string literal carry its length into a template argument
+template<std::size_t N>
+struct FixedString {
+    char data[N]{};
+
+    constexpr FixedString(const char (&s)[N]) {
+        for (std::size_t i = 0; i < N; i++)
+            data[i] = s[i];
+    }
+};
+
+namespace literals
+{
+    template<FixedString S>
+    consteval float operator""_eval() {
+        return ct_eval(S.data);
+    }
+} // namespace literals
+
+} // namespace psv
+
+#endif //MATH_MATTERS_CONST_EVAL_H
@@ -0,0 +1,104 @@
+#ifndef MATH_MATTERS_DEFINITIONS_H
+#define MATH_MATTERS_DEFINITIONS_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "MathProcessor.h"
+
+namespace psv
+{
+
+// Named definitions on top of the evaluator:
+//
+//     Definitions definitions;
+//     definitions.define("a = 3*4");
+//     definitions.define("b = a^2 - 1");
+//     definitions.define("c = b/a");
+//     definitions.update();
+//     definitions.value("c");            // 11.9166...
+//     definitions.define("a = 2");       // marks a, b and c dirty, nothing else
+//     definitions.update();              // recomputes just those three
+//
+// Each definition is a node in a dependency graph. Editing one marks it and
+// everything downstream of it dirty; update() recomputes the dirty nodes in
+// topological order, a wave of mutually independent nodes at a time, spreading a
+// wave over several threads when it's big enough to be worth it.
+// A name is evaluated by substituting the values of the names it uses into its
+// expression, so values and errors are exactly evaluate()'s. Error offsets are into
+// the expression (the text after '='). Each evaluation stays within budget(), counted
+// on the expression with the values substituted in.
+class Definitions {
+public:
+    // "name = expression". Only the syntax of the line is checked here; errors in the
+    // expression turn up as the definition's value after update().
+    Error define(const std::string &line);
+    // Redefining a name with the same expression changes nothing
+    void define(const std::string &name, const std::string &expression);
+    void remove(const std::string &name);
+    void clear();
+
+    // Recompute every dirty definition; returns how many that was
+    std::size_t update(unsigned threads = 0);
+
+    // What each definition's evaluation may use up; unlimited unless set. One that
+    // needs more has ErrorCode::BudgetExceeded as its value. Setting it marks every
+    // definition dirty.
+    void setBudget(const Budget &budget);
+    const Budget &budget() const;
+
+    // Query
+    bool contains(const std::string &name) const;
+    // As of the last update()
+    Result<float> value(const std::string &name) const;
+    const std::string &expression(const std::string &name) const;
+    // Defined names, in the order the names first turned up
+    std::vector<std::string> names() const;
+    std::size_t size() const;
+    std::size_t dirtyCount() const;
+
+private:
+    using NodeId = std::uint32_t;
+
+    // A name used in an expression
+    struct Reference {
+        NodeId node;
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    struct Node {
+        std::string name;
+        std::string expression;
+        // false for a name that's only been used (or was removed), not defined
+        bool defined = false;
+        bool dirty = false;
+        std::vector<Reference> references;
+        // distinct nodes on either side of this one
+        std::vector<NodeId> dependencies;
+        std::vector<NodeId> dependents;
+        Result<float> value = Error{ErrorCode::UnknownName};
+        // update()'s count of dirty dependencies not yet recomputed
+        std::uint32_t waiting = 0;
+    };
+
+    NodeId node(const std::string &name);
+    void unlink(NodeId id);
+    void markDirty(NodeId id);
+    Result<float> compute(const Node &node) const;
+
+    std::vector<Node> _nodes;
+    std::unordered_map<std::string, NodeId> _ids;
+    std::vector<NodeId> _dirty;
+    std::size_t _defined = 0;
+    Budget _budget;
+};
+
+// Splits a line of the form "name = expression"; InvalidDefinition otherwise, which
+// includes naming a built-in function
+Error splitDefinition(const std::string &line, std::string &name, std::string &expression);
+
+} // namespace psv
+
+#endif //MATH_MATTERS_DEFINITIONS_H
@@ -0,0 +1,33 @@
+#ifndef MATH_MATTERS_FAST_MATH_H
+#define MATH_MATTERS_FAST_MATH_H
+#include <cstddef>
+#include "MathProcessor.h"
+
+// Opt-in "fast math" evaluation. evaluate() reduces a+b+c+d as ((a+b)+c)+d, a
+// chain where every step waits on the one before. Here each run of + and - (or
+// of * and /) at one level is collected first and then reduced pairwise in double,
+// several lanes at a time, so the CPU can overlap the additions and the compiler
+// can vectorize them:
+//   - a - b becomes a + (-b), a / b becomes a * (1/b)
+//   - the error of a long sum grows with log(n) rather than n, on top of the
+//     extra precision of double, so results are usually closer to exact than
+//     evaluate()'s, but not bit for bit the same
+//   - intermediates are doubles, so e.g. 1e30*1e30/1e40 is 1e20 rather than inf
+// Errors (codes and offsets) are the same as evaluate()'s, and so are the limits of
+// context.budget; each operator is a reduction. There are no steps.
+
+namespace psv
+{
+    // Chains shorter than this are summed (or multiplied) in one pass of lanes
+    constexpr std::size_t pairwise_block = 128;
+
+    double pairwiseSum(const double *terms, std::size_t count);
+    double pairwiseProduct(const double *factors, std::size_t count);
+
+    Result<float> evaluateFastMath(const equation &eq, EvaluationContext &context);
+
+    // Uses a context of its own, one per thread
+    Result<float> evaluateFastMath(const equation &eq);
+}
+
+#endif //MATH_MATTERS_FAST_MATH_H
@@ -0,0 +1,239 @@
+#ifndef MATH_MATTERS_FUNCTIONS_H
+#define MATH_MATTERS_FUNCTIONS_H
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+#include "Result.h"
+
+// Built-in functions: sqrt abs min max log exp sin cos floor mod.
+//
+// prepare() turns each call's name into a one-character opcode, so from then on a
+// function is a single character like any operator and calling one is an index into
+// `functions` rather than a string compare. Arity is checked while preparing.
+// The kernels are branch-free so functionColumn() vectorizes; scalar calls run the
+// very same code, so the two agree bit for bit. log, exp, sin and cos work in
+// double and round once at the end, which puts them within an ulp of libm's.
+// Everything here is constexpr too, for constEvaluate() (ConstEval.h): sqrt, abs and
+// mod swap libm for exact versions while constant evaluated.
+
+namespace psv
+{
+    enum class Function : unsigned char {
+        Sqrt, Abs, Min, Max, Log, Exp, Sin, Cos, Floor, Mod,
+    };
+    constexpr std::size_t function_count = 10;
+
+    // Opcodes are control characters no one types; prepare() rejects them as input
+    constexpr char first_opcode = '\x10';
+
+    constexpr bool isFunction(char c) {
+        return c >= first_opcode && c < static_cast<char>(first_opcode + function_count);
+    }
+
+    constexpr char opcode(Function function) {
+        return static_cast<char>(first_opcode + static_cast<int>(function));
+    }
+
+    constexpr Function functionOf(char opcode) {
+        return static_cast<Function>(opcode - first_opcode);
+    }
+
+    // sin and cos reduce their argument against a two-part pi/2, which stays exact
+    // up to here; anything larger goes to std::sin/std::cos
+    constexpr float trig_reduction_limit = 65536.0f;
+
+    // Exact stand-ins for libm while constant evaluated
+    constexpr float constSqrt(float x) {
+        if (!(x > 0) || x == std::numeric_limits<float>::infinity())
+            return x == 0 || x == std::numeric_limits<float>::infinity() ? x : std::numeric_limits<float>::quiet_NaN();
+        // Newton's method from above only ever decreases until it settles; in double
+        // it lands on the value std::sqrt rounds to
+        double root = x > 1 ? x : 1;
+        for (;;) {
+            const double next = 0.5 * (root + x / root);
+            if (next >= root)
+                break;
+            root = next;
+        }
+        return static_cast<float>(root);
+    }
+
+    constexpr float constFmod(float a, float b) {
+        if (a != a || b != b || b == 0 || a == std::numeric_limits<float>::infinity() ||
+            a == -std::numeric_limits<float>::infinity())
+            return std::numeric_limits<float>::quiet_NaN();
+        const bool negative = std::bit_cast<std::uint32_t>(a) >> 31;
+        double rest = negative ? -static_cast<double>(a) : a;
+        const double divisor = b < 0 ? -static_cast<double>(b) : b;
+        // subtract the largest divisor * 2^k that fits; each subtraction is exact
+        while (rest >= divisor) {
+            double chunk = divisor;
+            while (chunk * 2 <= rest)
+                chunk *= 2;
+            rest -= chunk;
+        }
+        return static_cast<float>(negative ? -rest : rest);
+    }
+
+    // Kernels
+    constexpr float squareRoot(float x) {
+        if (std::is_constant_evaluated())
+            return constSqrt(x);
+        return std::sqrt(x);
+    }
+
+    constexpr float absolute(float x) {
+        if (std::is_constant_evaluated())
+            return std::bit_cast<float>(std::bit_cast<std::uint32_t>(x) & 0x7FFFFFFFu);
+        return std::fabs(x);
+    }
+
+    // NaN in, NaN out, like the operators
+    constexpr float minimum(float a, float b) {
+        return a != a || b != b ? a + b : (b < a ? b : a);
+    }
+
+    constexpr float maximum(float a, float b) {
+        return a != a || b != b ? a + b : (a < b ? b : a);
+    }
+
+    // Like C's fmod: the sign of the dividend. A zero divisor is checked by the caller.
+    constexpr float modulo(float a, float b) {
+        if (std::is_constant_evaluated())
+            return constFmod(a, b);
+        return std::fmod(a, b);
+    }
+
+    constexpr float floorOf(float x) {
+        // Anything from 2^23 up is already integral (as are inf and NaN);
+        // what's left fits an int. floor(-0) is -0, which the int would lose.
+        const bool small = absolute(x) < 0x1p23f && x != 0;
+        const float safe = small ? x : 0.0f;
+        const float truncated = static_cast<float>(static_cast<std::int32_t>(safe));
+        const float floored = truncated > safe ? truncated - 1 : truncated;
+        return small ? floored : x;
+    }
+
+    constexpr float naturalLog(float x) {
+        // x = 2^e * m with m in [sqrt(1/2), sqrt(2)), ln x = e ln 2 + 2 atanh((m - 1) / (m + 1)).
+        // Float subnormals are normal doubles, so they need no special care.
+        const std::uint64_t bits = std::bit_cast<std::uint64_t>(static_cast<double>(x));
+        double m = std::bit_cast<double>((bits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull);
+        // the biased exponent, as a double, without an integer conversion
+        double e = std::bit_cast<double>((bits >> 52 & 0x7FF) | 0x4330000000000000ull) - (0x1p52 + 1023);
+        const bool high = m > 1.4142135623730951;
+        m = high ? m * 0.5 : m;
+        e = high ? e + 1 : e;
+        const double s = (m - 1) / (m + 1);
+        const double z = s * s;
+        const double series = 1 + z * (1.0 / 3 + z * (1.0 / 5 + z * (1.0 / 7 + z * (1.0 / 9 + z * (1.0 / 11 + z * (1.0 / 13))))));
+        const double result = e * 0.6931471805599453 + 2 * s * series;
+        const float special = x == 0 ? -std::numeric_limits<float>::infinity()
+                                     : x < 0 ? std::numeric_limits<float>::quiet_NaN() : x;
+        return x > 0 && x < std::numeric_limits<float>::infinity() ? static_cast<float>(result) : special;
+    }
+
+    constexpr float exponential(float x) {
+        // e^x = 2^k * e^r, k = round(x / ln 2), |r| <= ln(2) / 2. Past +-110 the float
+        // has long since gone to inf or 0, so clamping there changes nothing.
+        constexpr double round_shift = 0x1.8p52;
+        const double d = std::min(110.0, std::max(-110.0, static_cast<double>(x)));
+        const double shifted = d * 1.4426950408889634 + round_shift;
+        const double k = shifted - round_shift;
+        // ln 2 in two parts, the first short enough that k times it is exact
+        const double r = (d - k * 0.693147180369123816490) - k * 1.90821492927058770002e-10;
+        const double series = 1 + r * (1 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 +
+                              r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880 + r * (1.0 / 3628800))))))))));
+        // k sits in the low bits of shifted; 2^k built straight into a double's exponent
+        const double scale = std::bit_cast<double>((std::bit_cast<std::uint64_t>(shifted) + 1023) << 52);
+        return x != x ? x : static_cast<float>(series * scale);
+    }
+
+    // sin(x + quarter * pi / 2) for |x| <= trig_reduction_limit
+    constexpr float reducedSine(float x, unsigned quarter) {
+        constexpr double round_shift = 0x1.8p52;
+        const double d = x;
+        const double shifted = d * 0.63661977236758134308 + round_shift;
+        const double k = shifted - round_shift;
+        // pi/2 in two parts (fdlibm's), the first with 33 bits so k times it is exact
+        const double r = (d - k * 1.57079632673412561417e+00) - k * 6.07710050650619224932e-11;
+        const double z = r * r;
+        const double sine = r * (1 + z * (-1.0 / 6 + z * (1.0 / 120 + z * (-1.0 / 5040 + z * (1.0 / 362880 +
+                            z * (-1.0 / 39916800 + z * (1.0 / 6227020800)))))));
+        const double cosine = 1 + z * (-1.0 / 2 + z * (1.0 / 24 + z * (-1.0 / 720 + z * (1.0 / 40320 +
+                              z * (-1.0 / 3628800 + z * (1.0 / 479001600 + z * (-1.0 / 87178291200)))))));
+        const auto q = static_cast<unsigned>(std::bit_cast<std::uint64_t>(shifted)) + quarter;
+        const double value = q & 1 ? cosine : sine;
+        return static_cast<float>(q & 2 ? -value : value);
+    }
+
+    constexpr float sine(float x) {
+        if (!(absolute(x) <= trig_reduction_limit))
+            return std::sin(x);
+        return reducedSine(x, 0);
+    }
+
+    constexpr float cosine(float x) {
+        if (!(absolute(x) <= trig_reduction_limit))
+            return std::cos(x);
+        return reducedSine(x, 1);
+    }
+
+    struct FunctionInfo {
+        std::string_view name;
+        unsigned arity;
+        // The last argument is a divisor, and zero is a ZeroDivision, as with '/'
+        bool divides;
+        float (*apply)(const float *args);
+    };
+
+    // Indexed by Function, i.e. by opcode - first_opcode
+    inline constexpr std::array<FunctionInfo, function_count> functions = {{
+        {"sqrt", 1, false, [](const float *args) { return squareRoot(args[0]); }},
+        {"abs", 1, false, [](const float *args) { return absolute(args[0]); }},
+        {"min", 2, false, [](const float *args) { return minimum(args[0], args[1]); }},
+        {"max", 2, false, [](const float *args) { return maximum(args[0], args[1]); }},
+        {"log", 1, false, [](const float *args) { return naturalLog(args[0]); }},
+        {"exp", 1, false, [](const float *args) { return exponential(args[0]); }},
+        {"sin", 1, false, [](const float *args) { return sine(args[0]); }},
+        {"cos", 1, false, [](const float *args) { return cosine(args[0]); }},
+        {"floor", 1, false, [](const float *args) { return floorOf(args[0]); }},
+        {"mod", 2, true, [](const float *args) { return modulo(args[0], args[1]); }},
+    }};
+
+    // Largest arity in the table
+    constexpr unsigned max_arity = 2;
+
+    constexpr const FunctionInfo &functionInfo(char opcode) {
+        return functions[static_cast<std::size_t>(opcode - first_opcode)];
+    }
+
+    // The function called name, or function_count when there isn't one
+    constexpr std::size_t findFunction(std::string_view name) {
+        for (std::size_t f = 0; f < function_count; f++) {
+            if (functions[f].name == name)
+                return f;
+        }
+        return function_count;
+    }
+
+    // args[0 .. arity); the Error has no offset, the caller knows where the call was
+    constexpr Result<float> applyFunction(char opcode, const float *args) {
+        const FunctionInfo &info = functionInfo(opcode);
+        if (info.divides && args[info.arity - 1] == 0)
+            return Error{ErrorCode::ZeroDivision};
+        return info.apply(args);
+    }
+
+    // out[i] = function(args[0][i], ..., args[arity - 1][i]). Zero divisors aren't
+    // checked here; callers that care look at the divisor column themselves.
+    void functionColumn(Function function, const float *const *args, float *out, std::size_t count);
+
+} // namespace psv
+
+#endif //MATH_MATTERS_FUNCTIONS_H
@@ -0,0 +1,109 @@
+#ifndef MATH_MATTERS_INTERFACE_H
+#define MATH_MATTERS_INTERFACE_H
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ftxui/component/component.hpp"
+#include "ftxui/component/event.hpp"
+#include "Definitions.h"
+#include "MathProcessor.h"
+#include "ResultStore.h"
+
+namespace psv
+{
+
+// The TUI: every component and the state behind them. main.cpp runs it on the
+// terminal; bench/replay.cpp feeds it recorded keystrokes offscreen to time it.
+// Evaluates with the default context (and sets psv::budget for typing), and logs
+// to the "basic_logger" and "step_logger" spdlog loggers, which the caller creates.
+class Interface {
+public:
+    // rows() is the height of the screen, which decides how many steps fit. With a
+    // store, statements evaluated before come back from it, those you evaluate (Enter
+    // or the button) are kept in it, and the History tab lists them.
+    explicit Interface(std::function<int()> rows, ResultStore *store = nullptr);
+
+    // The components capture this
+    Interface(const Interface &) = delete;
+    Interface &operator=(const Interface &) = delete;
+
+    ftxui::Component component() const;
+
+private:
+    int visibleSteps() const;
+    void evaluateStatement();
+    void remember();
+    void recall();
+    void updateDefinitions();
+    void refreshHistory();
+    ftxui::Element renderSteps();
+    ftxui::Element renderSolver();
+    ftxui::Element renderDefinitions();
+    ftxui::Element renderHistory();
+
+    std::function<int()> _rows;
+    ResultStore *_store;
+
+    // Statement Solver
+    std::string _statement;
+    float _result = 0;
+    std::string _result_string;
+    std::stringstream _result_stream;
+    std::string _warning_msg;
+    Error _error_at;
+    bool _reveal_answer = false;
+    int _step_offset = 0; // first step in the Steps window
+    bool _show_steps = true;
+    bool _show_warnings = false;
+    bool _valid_input = true;
+    bool _anything_entered = false;
+    // prepare()'s output, to look the statement up by
+    equation _normalized;
+    std::vector<std::size_t> _origin;
+    // what the steps point into when they came from the store
+    std::string _recalled_steps;
+
+    // One "name = expression" per line; values are kept up to date as you type, and
+    // an edit only recomputes the definitions downstream of the line that changed
+    struct DefinitionLine {
+        std::string label; // the name, or the whole line when it isn't a definition
+        Error error;
+    };
+    std::string _definitions_text;
+    Definitions _definitions;
+    std::vector<DefinitionLine> _definition_lines;
+
+    // History, as of the store's version when it was read
+    std::vector<ResultStore::Entry> _history;
+    std::vector<std::string> _history_labels;
+    int _history_selected = 0;
+    std::uint64_t _history_version = 0;
+
+    int _tab_index = 0;
+    std::vector<std::string> _tabs = {"Statement Solver", "Definitions", "History", "Settings"};
+
+    ftxui::Component _input_statement;
+    ftxui::Component _button_evaluate;
+    ftxui::Component _button_reset;
+    ftxui::Component _steps;
+    ftxui::Component _toggle_steps;
+    ftxui::Component _toggle_warnings;
+    ftxui::Component _input_definitions;
+    ftxui::Component _history_menu;
+    ftxui::Component _tab_selection;
+    ftxui::Component _tab_content;
+    ftxui::Component _root;
+};
+
+// Recorded sessions are one event per line: the bytes the terminal sent, with
+// '\' and anything outside printable ASCII written as \xHH. Mouse events aren't kept.
+void writeEvent(std::ostream &out, const ftxui::Event &event);
+std::vector<ftxui::Event> readSession(std::istream &in);
+
+} // namespace psv
+
+#endif //MATH_MATTERS_INTERFACE_H
@@ -5,11 +5,15 @@
 #include <vector>
 #include <array>
 #include <algorithm>
-#include <map>
-#include <cmath>
-#include <regex>
-#include <boost/regex.hpp>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
 #include "Stack.h"
+#include "Result.h"
+#include "Arena.h"
+#include "Power.h"
+#include "Budget.h"
+#include "Functions.h"
 
 #ifndef MATH_MATTERS_INPUT_H
 #define MATH_MATTERS_INPUT_H
@@ -17,41 +21,424 @@
 namespace psv {
     using equation = std::string;
 
+    // An operator waiting on the stack, along with where it was in the statement
+    struct Operator {
+        char symbol;
+        std::size_t offset;
+    };
+
+    struct Span {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    // Everything one evaluation needs, kept between evaluations so that, once warmed
+    // up, evaluating doesn't touch the heap. Steps point into the arena and are only
+    // valid until the next evaluate() with the same context.
+    struct EvaluationContext {
+        Arena arena;
+        std::vector<std::string_view> steps;
+        // Unlimited unless set. After ErrorCode::BudgetExceeded, meter.exceeded()
+        // says which limit it was.
+        Budget budget;
+        Meter meter;
+
+        // scratch
+        equation normalized;
+        std::vector<std::size_t> origin;
+        std::string last_step;
+        Stack<float> output;
+        Stack<Operator> operators;
+    };
+
 // Primary Logic
+    // Does not throw; on failure the Error points into eq (whitespace included).
+    // Statements of parallel_threshold characters or more go to evaluatePrepared()
+    // (ParallelEvaluator.h) and record no steps. Both ways stay within context.budget.
+    Result<float> evaluate(const equation &eq, EvaluationContext &context);
+
+    // Uses a shared default context, whose steps are psv::steps and budget psv::budget.
+    // It and nonRpnEvaluate live in DefaultContext.cpp, which libmathmatters leaves out.
+    Result<float> evaluate(const equation &eq);
+
+    // evaluate() for a statement prepare() has already been run on, so it isn't
+    // prepared twice; size is the length of the statement origin points into.
+    // The second uses the shared default context.
+    Result<float> evaluateNormalized(const equation &normalized, const std::vector<std::size_t> &origin,
+                                     std::size_t size, EvaluationContext &context);
+    Result<float> evaluateNormalized(const equation &normalized, const std::vector<std::size_t> &origin,
+                                     std::size_t size);
+
+    // Whitespace stripped, function names replaced by their opcodes (Functions.h),
+    // unary minus rewritten to 'n'/'m' and validated; origin maps each normalized
+    // character back to eq. Shared by evaluate and the batch compiler.
+    Error prepare(const equation &eq, equation &normalized, std::vector<std::size_t> &origin);
+
+    // Same as evaluate, but throws std::invalid_argument on failure
     float nonRpnEvaluate(const equation &eq);
 
-    void cycleStack(Stack<float> &output, Stack<char> &operators);
+    Error cycleStack(EvaluationContext &context);
+
+    // Higher binds tighter; shared by the runtime and compile-time evaluators.
+    // A function binds tightest of all: it comes off the stack as soon as anything
+    // follows its closing ')'.
+    constexpr int precedence(char op) {
+        switch (op) {
+            case 'm': return 6;
+            case '^': return 5;
+            case 'n': return 4;
+            case '*':
+            case '/': return 3;
+            case '+':
+            case '-': return 2;
+            case '(': return 1;
+            default: return isFunction(op) ? 7 : 0;
+        }
+    }
 
-    float operateBinary(float a, float b, char op);
+    constexpr Result<float> operateBinary(float a, float b, char op) {
+        switch (op) {
+            case '+':
+                return a + b;
+            case '-':
+                return a - b;
+            case '*':
+                return a * b;
+            case '/':
+                if (b == 0)
+                    return Error{ErrorCode::ZeroDivision};
+                return a / b;
+            case '^':
+                if (std::is_constant_evaluated())
+                    return constPow(a, b);
+                return power(a, b);
+            default:
+                return Error{ErrorCode::InvalidOperator};
+        }
+    }
 
     float operateUnary(float a, char op);
 
 // Parsing Functions
-    void checkValidCharacters(const equation &eq);
+// Validators return an empty Error when eq is fine; offsets are into eq. They, and
+// runShuntingYard() below, are constexpr so constEvaluate() (ConstEval.h) runs the
+// same code as prepare() and evaluate().
+    constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    constexpr bool isLetter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+    constexpr bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // What's valid, and what's an operator, as one lookup per character, since every
+    // validator runs over every character of the statement
+    enum : unsigned char { valid_character = 1, operator_character = 2 };
+    inline constexpr std::array<unsigned char, 256> character_classes = [] {
+        std::array<unsigned char, 256> classes{};
+        for (char c : std::string_view("0123456789.+-*/^() nm,"))
+            classes[static_cast<unsigned char>(c)] |= valid_character;
+        for (char c : std::string_view("+-*/^nm"))
+            classes[static_cast<unsigned char>(c)] |= operator_character;
+        // only ever put there by prepare(); typed ones are replaced before they're checked
+        for (std::size_t f = 0; f < function_count; f++)
+            classes[static_cast<unsigned char>(first_opcode + f)] |= valid_character;
+        return classes;
+    }();
+
+    constexpr bool isValidCharacter(char c) {
+        return character_classes[static_cast<unsigned char>(c)] & valid_character;
+    }
+
+    constexpr bool isOperator(char c) {
+        return character_classes[static_cast<unsigned char>(c)] & operator_character;
+    }
+
+    constexpr bool isUnary(char op) {
+        return op == 'n' || op == 'm';
+    }
+
+    std::vector<Span> invalidCharacters(const equation &eq);
+
+    constexpr Error checkValidCharacters(std::string_view eq) {
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            if (!isValidCharacter(eq[i])) {
+                std::size_t length = 1;
+                while (i + length < eq.size() && !isValidCharacter(eq[i + length])) {
+                    length++;
+                }
+                return {ErrorCode::InvalidCharacters, i, length};
+            }
+        }
+        return {};
+    }
+
+    // Only used for binary operators
+    constexpr bool validOperator(char preceding, char succeeding) {
+        if (isOperator(preceding) || preceding == '(' || preceding == ',')
+            return false;
+        if ((isOperator(succeeding) && !isUnary(succeeding)) || succeeding == ')' || succeeding == ',')
+            return false;
+        return true;
+    }
+
+    // Translate an Error on a normalized (whitespace-free) statement back onto what
+    // the user typed; origin[i] is where normalized character i came from.
+    template<typename Origin>
+    constexpr Error locate(Error err, const Origin &origin, std::size_t count, std::size_t original_size) {
+        if (err.offset >= count)
+            return {err.code, original_size, 0};
+        std::size_t end = err.offset + (err.length == 0 ? 1 : err.length);
+        std::size_t last = (end < count ? end : count) - 1;
+        std::size_t begin = origin[err.offset];
+        return {err.code, begin, err.length == 0 ? 0 : origin[last] + 1 - begin};
+    }
+
+    constexpr Error validOperators(std::string_view eq) {
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            const char op = eq[i];
+            const char left = i > 0 ? eq[i - 1] : '\0';
+            const char right = i + 1 < eq.size() ? eq[i + 1] : '\0';
+            if (isUnary(op)) {
+                if (i > 0 && !isOperator(left) && left != '(' && left != ',')
+                    return {ErrorCode::InvalidOperator, i, 1};
+                if (!isDigit(right) && right != '(' && !isFunction(right))
+                    return {ErrorCode::InvalidOperator, i, 1};
+            } else if (isOperator(op)) {
+                if (i == 0 || i + 1 == eq.size() || !validOperator(left, right))
+                    return {ErrorCode::InvalidOperator, i, 1};
+            } else if (((op == '(' || isFunction(op)) && (isDigit(left) || left == '.' || left == ')')) ||
+                       (left == ')' && (isDigit(op) || op == '.'))) {
+                return {ErrorCode::MissingOperator, i - 1, 2};
+            }
+        }
+        return {};
+    }
+
+    constexpr Error validScoping(std::string_view eq) {
+        std::size_t depth = 0;
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            if (eq[i] == '(') {
+                depth++;
+            } else if (eq[i] == ')') {
+                if (depth == 0) {
+                    return {ErrorCode::UnbalancedParentheses, i, 1};
+                }
+                if (eq[i - 1] == '(') {
+                    return {ErrorCode::EmptyExpression, i - 1, 2};
+                }
+                depth--;
+            }
+        }
+        if (depth != 0) {
+            // report the outermost paren left open: the earliest '(' whose depth is
+            // never given back by the rest of the statement
+            std::size_t open = 0;
+            std::size_t lowest = depth;
+            for (std::size_t i = eq.size(); i-- > 0;) {
+                lowest = std::min(lowest, depth);
+                if (eq[i] == '(') {
+                    if (lowest >= depth)
+                        open = i;
+                    depth--;
+                } else if (eq[i] == ')') {
+                    depth++;
+                }
+            }
+            return {ErrorCode::UnbalancedParentheses, open, 1};
+        }
+        return {};
+    }
+
+    // Commas only between the arguments of a call, and as many arguments as the
+    // function takes. Runs on a statement with balanced parentheses.
+    constexpr Error validCalls(std::string_view eq) {
+        if (std::none_of(eq.begin(), eq.end(), [](char c) { return c == ',' || isFunction(c); }))
+            return {};
+        // One per open '(': the call it belongs to (npos for a plain group) and its commas
+        struct Group {
+            std::size_t call;
+            unsigned commas;
+        };
+        std::vector<Group> groups;
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            const char c = eq[i];
+            if (c == '(') {
+                groups.push_back({i > 0 && isFunction(eq[i - 1]) ? i - 1 : std::string_view::npos, 0});
+            } else if (c == ',') {
+                if (groups.empty() || groups.back().call == std::string_view::npos)
+                    return {ErrorCode::InvalidCall, i, 1};
+                // an argument on either side
+                const char left = eq[i - 1];
+                const char right = i + 1 < eq.size() ? eq[i + 1] : '\0';
+                if (!(isDigit(left) || left == '.' || left == ')') ||
+                    !(isDigit(right) || right == '.' || right == '(' || right == 'n' || isFunction(right)))
+                    return {ErrorCode::InvalidCall, i, 1};
+                groups.back().commas++;
+            } else if (c == ')') {
+                const Group group = groups.back();
+                groups.pop_back();
+                if (group.call != std::string_view::npos && group.commas + 1 != functionInfo(eq[group.call]).arity)
+                    return {ErrorCode::InvalidCall, group.call, i + 1 - group.call};
+            }
+        }
+        return {};
+    }
 
-    bool validOperator(char preceding, char succeeding);
+    // Rewrites unary minus in a whitespace-free statement, in place: 'm' when it
+    // follows a '^', otherwise 'n' at the start or after an operator, '(' or ',' when
+    // a number, '(' or function follows. Right to left so each check sees the
+    // original character.
+    constexpr void markUnaryMinus(char *eq, std::size_t length) {
+        for (std::size_t i = 1; i < length; i++) {
+            if (eq[i] == '-' && eq[i - 1] == '^')
+                eq[i] = 'm';
+        }
+        for (std::size_t i = length; i-- > 0;) {
+            if (eq[i] != '-')
+                continue;
+            if (i == 0) {
+                eq[i] = 'n';
+                continue;
+            }
+            const char before = eq[i - 1];
+            const char after = i + 1 < length ? eq[i + 1] : '\0';
+            if ((before == '*' || before == '/' || before == '+' || before == '-' || before == '^' || before == '(' ||
+                 before == ',') &&
+                ((after >= '0' && after <= '9') || after == '(' || isFunction(after)))
+                eq[i] = 'n';
+        }
+    }
 
-    void validOperators(const equation &eq);
+    // eq without whitespace into out, origin[i] being where out[i] sat in eq; both
+    // need room for eq.size(). Returns the length left.
+    constexpr std::size_t stripWhiteSpace(std::string_view eq, char *out, std::size_t *origin) {
+        std::size_t length = 0;
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            if (isSpace(eq[i]))
+                continue;
+            out[length] = eq[i];
+            origin[length++] = i;
+        }
+        return length;
+    }
 
-    void validScoping(const equation &eq);
+    // Each function name followed by '(' becomes its opcode, in place, origin pointing at
+    // the name's first letter. Any other letters are left for checkValidCharacters.
+    // Returns the length left.
+    constexpr std::size_t markFunctions(char *eq, std::size_t *origin, std::size_t length) {
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < length;) {
+            char c = eq[i];
+            if (isLetter(c)) {
+                std::size_t end = i;
+                while (end < length && isLetter(eq[end]))
+                    end++;
+                const std::size_t function = findFunction(std::string_view(eq + i, end - i));
+                if (function != function_count && end < length && eq[end] == '(') {
+                    eq[kept] = opcode(static_cast<Function>(function));
+                    origin[kept++] = origin[i];
+                    i = end;
+                    continue;
+                }
+                for (; i < end; i++) {
+                    eq[kept] = eq[i];
+                    origin[kept++] = origin[i];
+                }
+                continue;
+            }
+            // a typed opcode is just an invalid character
+            if (isFunction(c))
+                c = '\x7f';
+            eq[kept] = c;
+            origin[kept++] = origin[i++];
+        }
+        return kept;
+    }
 
-    bool isOperator(const char &c);
+    // The rest of prepare() once the whitespace is gone, in place: function names to
+    // opcodes, unary minus to 'n'/'m', then every validator. length shrinks with the
+    // names; the Error's offsets are into what's left.
+    constexpr Error validateNormalized(char *normalized, std::size_t *origin, std::size_t &length) {
+        length = markFunctions(normalized, origin, length);
+        markUnaryMinus(normalized, length);
+        const std::string_view statement(normalized, length);
+        Error err = checkValidCharacters(statement);
+        if (!err)
+            err = validScoping(statement);
+        if (!err)
+            err = validCalls(statement);
+        if (!err)
+            err = validOperators(statement);
+        return err;
+    }
 
-    bool isUnary(char op);
+    // Shunting-yard over a statement validateNormalized() has passed. Each number goes
+    // to push_number(offset, length) and reduce() applies the operator on top of
+    // operators; either one's Error stops it. What's left on the output is the caller's.
+    template<typename Operators, typename PushNumber, typename Reduce>
+    constexpr Error runShuntingYard(std::string_view eq, Operators &operators, PushNumber push_number, Reduce reduce) {
+        std::size_t number_start = 0;
+        std::size_t number_length = 0;
+        for (std::size_t i = 0; i < eq.size(); i++) {
+            const char symbol = eq[i];
+            if (isDigit(symbol) || symbol == '.') {
+                if (number_length == 0)
+                    number_start = i;
+                number_length++;
+                continue;
+            } else if (number_length != 0) {
+                if (Error err = push_number(number_start, number_length))
+                    return err;
+                number_length = 0;
+            }
+            // => symbol is operator or parenthesis
+            if (operators.isEmpty() || symbol == '(') {
+                operators.place({symbol, i});
+            } else if (symbol == ')') {
+                while (operators.top().symbol != '(') {
+                    if (Error err = reduce())
+                        return err;
+                }
+                operators.pop();
+            } else if (symbol == ',') {
+                // finish the argument so far; the '(' stays for the next one
+                while (operators.top().symbol != '(') {
+                    if (Error err = reduce())
+                        return err;
+                }
+            } else { // is a binary operator or a function
+                while (!operators.isEmpty() && precedence(operators.top().symbol) >= precedence(symbol)) {
+                    if (Error err = reduce())
+                        return err;
+                }
+                operators.place({symbol, i});
+            }
+        }
+        if (number_length != 0) {
+            if (Error err = push_number(number_start, number_length))
+                return err;
+        }
+        // Utilize any remaining operators
+        while (!operators.isEmpty()) {
+            if (Error err = reduce())
+                return err;
+        }
+        return {};
+    }
 
     void eliminateWhiteSpace(equation &eq);
 
-    void parseLastStep(const std::string& target_exp, const std::string& target_reduced);
+    // Limit::StepBytes, without recording it, when the step doesn't fit context.budget
+    Limit parseLastStep(EvaluationContext &context, std::string_view target_exp, std::string_view target_reduced);
 
     void lonelyParentheses(equation &eq);
 
 
 // Accessible Variables
     extern std::vector<const char *> operatorLocations(const equation &eq);
-    extern std::vector<std::string> steps;
-    extern std::vector<const char*> invalid_characters;
-    extern const std::regex paren_no_op;
-    extern const boost::regex unary_minus;
+    extern std::vector<std::string_view> &steps;
+    extern Budget &budget;
 }
 
 #endif //MATH_MATTERS_INPUT_H
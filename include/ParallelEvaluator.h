@@ -0,0 +1,37 @@
+#ifndef MATH_MATTERS_PARALLEL_EVALUATOR_H
+#define MATH_MATTERS_PARALLEL_EVALUATOR_H
+#include <cstddef>
+#include "MathProcessor.h"
+
+// Evaluating one very large statement on several threads.
+//
+// The statement is split at its top-level operators of the lowest precedence it
+// has (for 1*2+3*(4-5)-6, the '+' and the '-'). The pieces are independent, so
+// they're evaluated concurrently, and their values are then folded left to right
+// with those operators, which is exactly the order shuntingYard applies them in.
+// A piece that is itself large is split again, so a statement that's one big
+// parenthesized group, product or '^' chain still spreads out. The splitting is
+// planned up front, without recursion, and the threads are started once for the
+// whole statement. A range where one piece holds nearly everything (1+2*(1+2*(...)))
+// isn't split at all: it's evaluated on one thread, as shuntingYard would.
+// Values and errors are identical to evaluate()'s, bit for bit.
+
+namespace psv
+{
+    // Statements (whitespace excluded) shorter than this aren't worth a thread
+    constexpr std::size_t parallel_threshold = 1 << 15;
+
+    // evaluate() without steps. threads == 0 uses every hardware thread; ranges
+    // shorter than grain are evaluated on whichever thread reaches them.
+    Result<float> evaluateParallel(const equation &eq, unsigned threads = 0,
+                                   std::size_t grain = parallel_threshold);
+
+    // Same, for a statement that already went through prepare(); offsets in the
+    // Error are into normalized. With a meter, every thread charges its reductions
+    // to it and they all stop once it runs out, so the offset of a BudgetExceeded
+    // is just wherever one of them stopped. Tokens and depth are the caller's to measure.
+    Result<float> evaluatePrepared(const equation &normalized, unsigned threads = 0,
+                                   std::size_t grain = parallel_threshold, Meter *meter = nullptr);
+}
+
+#endif //MATH_MATTERS_PARALLEL_EVALUATOR_H
@@ -0,0 +1,139 @@
+#ifndef MATH_MATTERS_POWER_H
+#define MATH_MATTERS_POWER_H
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Kernels behind '^'. Nearly every exponent we see is a small integer, so:
+//   - integral exponents go through repeated squaring in double, which is exact
+//     while the result fits in 53 bits and otherwise only rounds at the very end
+//   - results that are certainly out of float range are answered from the
+//     operands' binary exponents, before any multiplying (9^9^9^9 and friends)
+//   - everything else falls back to std::pow
+// powColumn() does the same for whole columns, with a fast path the compiler
+// vectorizes. All paths multiply in the same order, so they agree bit for bit.
+
+namespace psv
+{
+    // Integral exponents at most this large (in magnitude) take the fast paths
+    constexpr int column_exponent_limit = 127;
+    constexpr int small_power_rounds = 7;
+    static_assert((1 << small_power_rounds) > column_exponent_limit);
+
+    constexpr double squarePower(double base, unsigned long long n) {
+        double result = 1;
+        double square = base;
+        while (n > 0) {
+            if (n & 1) result *= square;
+            square *= square;
+            n >>= 1;
+        }
+        return result;
+    }
+
+    // squarePower() for 0 <= n <= column_exponent_limit, with a fixed number of
+    // rounds and the factor picked with a mask rather than the multiply skipped,
+    // so there are no data-dependent branches to mispredict. Multiplying by 1 is
+    // exact, so the result is squarePower()'s to the bit.
+    inline double smallPower(double base, int n) {
+        double result = 1;
+        double square = base;
+        for (int bit = 0; bit < small_power_rounds; bit++) {
+            const std::uint64_t take = 0 - static_cast<std::uint64_t>((n >> bit) & 1);
+            const std::uint64_t factor = (std::bit_cast<std::uint64_t>(square) & take) |
+                                         (std::bit_cast<std::uint64_t>(1.0) & ~take);
+            result *= std::bit_cast<double>(factor);
+            square *= square;
+        }
+        return result;
+    }
+
+    // std::pow isn't constexpr (yet), so the compile-time path gets its own:
+    // repeated squaring for integral exponents, exp(b * ln(a)) for the rest.
+    constexpr double constLog(double x) {
+        int k = 0;
+        while (x >= 2) { x /= 2; k++; }
+        while (x < 1) { x *= 2; k--; }
+        // ln(x) = 2 * atanh((x - 1) / (x + 1)), x in [1, 2)
+        const double z = (x - 1) / (x + 1);
+        double term = z;
+        double sum = 0;
+        for (int i = 1; i < 40; i += 2) {
+            sum += term / i;
+            term *= z * z;
+        }
+        return 2 * sum + k * 0.6931471805599453;
+    }
+
+    constexpr double constExp(double x) {
+        if (x > 128 * 0.6931471805599453)
+            return std::numeric_limits<double>::infinity();
+        if (x < -150 * 0.6931471805599453)
+            return 0;
+        // exp(x) = 2^k * exp(r), |r| <= ln(2) / 2
+        const int k = static_cast<int>(x / 0.6931471805599453 + (x < 0 ? -0.5 : 0.5));
+        const double r = x - k * 0.6931471805599453;
+        double term = 1;
+        double sum = 1;
+        for (int i = 1; i < 20; i++) {
+            term *= r / i;
+            sum += term;
+        }
+        for (int i = 0; i < k; i++) sum *= 2;
+        for (int i = 0; i > k; i--) sum /= 2;
+        return sum;
+    }
+
+    constexpr float constPow(float base, float exponent) {
+        const double e = exponent;
+        if (base == 0)
+            return e == 0 ? 1.0f : e < 0 ? std::numeric_limits<float>::infinity() : 0.0f;
+        if ((e < 0 ? -e : e) < 4611686018427387904.0 && e == static_cast<double>(static_cast<long long>(e))) {
+            const double result = squarePower(base, static_cast<unsigned long long>(e < 0 ? -e : e));
+            return static_cast<float>(e < 0 ? 1 / result : result);
+        }
+        // any float this large is an even integer
+        const bool huge = (e < 0 ? -e : e) >= 4611686018427387904.0;
+        if (base < 0 && !huge)
+            return std::numeric_limits<float>::quiet_NaN();
+        return static_cast<float>(constExp(e * constLog(base < 0 ? -base : base)));
+    }
+
+    // Runtime '^'
+    inline float power(float base, float exponent) {
+        const float magnitude = std::fabs(exponent);
+        if (magnitude <= static_cast<float>(column_exponent_limit)) {
+            // Common case; the double can't run out of range before the float does
+            const int n = static_cast<int>(magnitude);
+            if (static_cast<float>(n) != magnitude)
+                return std::pow(base, exponent);
+            const double result = smallPower(base, n);
+            return static_cast<float>(exponent < 0 ? 1 / result : result);
+        }
+        // 2^31 keeps the exponent in a long long and the squaring loop at <= 31 rounds
+        if (magnitude < 2147483648.0f && magnitude == std::trunc(magnitude) && std::isfinite(base) && base != 0) {
+            const long long n = static_cast<long long>(exponent);
+            // |base| is in [2^k, 2^(k+1)), so |base^n| is between 2^(k*n) and 2^((k+1)*n)
+            const long long k = std::ilogb(base);
+            const long long low = std::min(k * n, (k + 1) * n);
+            const long long high = std::max(k * n, (k + 1) * n);
+            const bool negative = base < 0 && (n & 1);
+            if (low >= 129)
+                return negative ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+            if (high < -150)
+                return negative ? -0.0f : 0.0f;
+            const double result = squarePower(base, static_cast<unsigned long long>(n < 0 ? -n : n));
+            return static_cast<float>(n < 0 ? 1 / result : result);
+        }
+        return std::pow(base, exponent);
+    }
+
+    // out[i] = power(base[i], exponent[i])
+    void powColumn(const float *base, const float *exponent, float *out, std::size_t count);
+
+} // namespace psv
+
+#endif //MATH_MATTERS_POWER_H
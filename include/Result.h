@@ -0,0 +1,64 @@
+#ifndef MATH_MATTERS_RESULT_H
+#define MATH_MATTERS_RESULT_H
+#include <cstddef>
+
+namespace psv
+{
+
+enum class ErrorCode {
+    None = 0,
+    InvalidCharacters,
+    UnbalancedParentheses,
+    InvalidOperator,
+    MissingOperator,
+    InvalidNumber,
+    EmptyExpression,
+    ZeroDivision,
+    TooLong,
+    // Definitions
+    InvalidDefinition,
+    UnknownName,
+    BadReference,
+    CyclicDefinition,
+    // Budgets (Budget.h)
+    BudgetExceeded,
+    // Functions (Functions.h)
+    InvalidCall,
+};
+
+// Where something went wrong, as a byte range into the statement the user typed
+// (whitespace included), so the UI can highlight it directly.
+struct Error {
+    ErrorCode code = ErrorCode::None;
+    std::size_t offset = 0;
+    std::size_t length = 0;
+
+    // true when this actually describes an error
+    constexpr explicit operator bool() const { return code != ErrorCode::None; }
+};
+
+const char *errorMessage(ErrorCode code);
+
+// A value or the Error explaining why there isn't one.
+// Think std::expected, minus the C++23.
+template<typename T>
+class Result {
+public:
+    constexpr Result(T value) : _value(value), _error() {}
+    constexpr Result(Error error) : _value(), _error(error) {}
+
+    constexpr bool ok() const { return !_error; }
+    constexpr explicit operator bool() const { return ok(); }
+
+    constexpr const T &value() const { return _value; }
+    constexpr const T &operator*() const { return _value; }
+    constexpr const Error &error() const { return _error; }
+
+private:
+    T _value;
+    Error _error;
+};
+
+} // namespace psv
+
+#endif //MATH_MATTERS_RESULT_H
@@ -0,0 +1,110 @@
+#ifndef MATH_MATTERS_RESULT_STORE_H
+#define MATH_MATTERS_RESULT_STORE_H
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Results that outlive the process (POSIX only): a file, mapped into memory, from
+// normalized statement (prepare()'s output) to its value, the statement as it was
+// typed and, when it was evaluated with steps, the steps, delta-encoded.
+//
+// The file has a fixed size, set when it's created: an index of buckets of slots
+// and a circular log of records. Storing appends to the log and points a slot at
+// the new record; once the log is full the oldest records are written over, and
+// when a bucket is full its oldest slot goes. A hit on a record that's about to
+// be written over copies it to the front, so what keeps being recalled stays.
+//
+// Any number of processes (and threads) can use the same file: lookups hold a
+// shared flock() and stores an exclusive one. A record only becomes visible once
+// it's completely written, so a process dying halfway through a store loses that
+// store and nothing else. Open it after fork(), not before: a child sharing its
+// parent's descriptor shares its locks too.
+
+namespace psv
+{
+    struct StoreOptions {
+        // Only used when the file is created; an existing one keeps its own size.
+        // Rounded up to a power of two / whole pages.
+        std::size_t slots = 1 << 18;
+        std::size_t log_bytes = 16 << 20;
+    };
+
+    class ResultStore {
+    public:
+        struct Entry {
+            std::string normalized;
+            std::string statement;
+            float value;
+            // seconds since the epoch, when it was stored
+            std::int64_t time = 0;
+        };
+
+        struct Stats {
+            std::uint64_t lookups;
+            std::uint64_t hits;
+            std::uint64_t stores;
+        };
+
+        // Opens path, creating it when it doesn't exist. Throws std::system_error
+        // when it can't, or when the file is something other than a store.
+        explicit ResultStore(const std::string &path, const StoreOptions &options = {});
+        ~ResultStore();
+
+        ResultStore(const ResultStore &) = delete;
+        ResultStore &operator=(const ResultStore &) = delete;
+
+        std::optional<float> find(const std::string &normalized);
+
+        // Also the steps, which point into storage. False when the statement was
+        // stored without them (batch mode has none to give).
+        bool find(const std::string &normalized, float &value, std::string &storage,
+                  std::vector<std::string_view> &steps);
+
+        // steps is nullptr when they're unknown, rather than none. Values that
+        // aren't finite, and statements too big for the log, aren't kept; nor is a
+        // result without steps in place of one with them. Storing what's already
+        // there with steps (the same statement entered again) does nothing.
+        void store(const std::string &normalized, const std::string &statement, float value,
+                   const std::vector<std::string_view> *steps = nullptr);
+
+        // Many at once, under one lock (for batch mode)
+        std::vector<std::optional<float>> findAll(const std::vector<std::string> &normalized);
+        void storeAll(const std::vector<Entry> &entries);
+
+        // Most recent first, one per statement still in the store
+        std::vector<Entry> history(std::size_t count);
+
+        // Changes whenever something is stored, by any process
+        std::uint64_t version() const;
+
+        Stats stats() const;
+
+    private:
+        struct Header;
+        struct Slot;
+        struct Record;
+        class Lock;
+
+        Header &header() const;
+        Slot *bucket(std::uint64_t hash) const;
+        const Record *record(std::uint64_t position) const;
+        const Record *lookup(std::uint64_t hash, std::string_view normalized, Slot **slot = nullptr) const;
+        bool ageing(std::uint64_t position) const;
+        void promote(std::uint64_t hash, const std::string &normalized);
+        void append(std::uint64_t hash, std::string_view normalized, std::string_view statement, float value,
+                    std::int64_t time, const std::string *trace, std::uint32_t step_count);
+
+        int _fd = -1;
+        char *_memory = nullptr;
+        std::size_t _size = 0;
+        // flock() only tells processes apart, so threads take turns here first
+        std::mutex _mutex;
+        std::string _trace;
+    };
+}
+
+#endif //MATH_MATTERS_RESULT_STORE_H
@@ -0,0 +1,49 @@
+#ifndef MATH_MATTERS_SHARDED_EVALUATOR_H
+#define MATH_MATTERS_SHARDED_EVALUATOR_H
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include "Result.h"
+
+// Batch evaluation of very large files on several worker processes (POSIX only).
+//
+// The coordinator maps the file, cuts it into ranges of lines and hands those out
+// through a single-producer/multi-consumer ring in shared memory; forked workers
+// claim ranges, evaluate each line and write its result straight into a shared
+// array with a slot per line, which the coordinator reads back in input order. No
+// statement or result goes through a pipe. A worker that dies is noticed with
+// waitpid(), the rest of its range goes back in the ring and a new worker takes
+// its place; a line that kills its worker every time is given up on rather than
+// retried forever. Results are the same as BatchCompiler's, bit for bit.
+
+namespace psv
+{
+    struct ShardOptions {
+        // 0 for one per hardware thread
+        unsigned workers = 0;
+        std::size_t lines_per_task = 4096;
+        // Times a line may take down its worker before it's reported as crashed
+        unsigned max_attempts = 2;
+        // Runs in the worker before each line, e.g. for tests to crash one
+        void (*before_line)(std::size_t line) = nullptr;
+    };
+
+    struct ShardStats {
+        std::size_t lines = 0;
+        std::size_t tasks = 0;
+        // workers that died, and the ranges that went back in the ring because of it
+        std::size_t crashes = 0;
+        std::size_t reassigned = 0;
+    };
+
+    // Called in input order with each line's result, or nullopt for a line that
+    // kept crashing its worker. Runs in the coordinator, as results come in.
+    using ShardSink = std::function<void(std::size_t line, const std::optional<Result<float>> &result)>;
+
+    // Lines are split on '\n' like std::getline. Throws std::system_error when the
+    // file can't be read or no worker can be started.
+    ShardStats evaluateSharded(const std::string &path, const ShardOptions &options, const ShardSink &sink);
+}
+
+#endif //MATH_MATTERS_SHARDED_EVALUATOR_H
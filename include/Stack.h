@@ -5,6 +5,8 @@
 #ifndef MATH_MATTERS_STACK_CPP
 #define MATH_MATTERS_STACK_CPP
 #include <cstddef>
+#include <stdexcept>
+#include <utility>
 
 namespace psv
 {
@@ -31,22 +33,28 @@ public:
     T top();
 
 private:
+    void grow();
+
     int _size;
+    int _capacity;
     int _topIndex;
     T *_stack;
 };
 
 template<typename T>
-Stack<T>::Stack() : _size(0), _topIndex(-1){
+Stack<T>::Stack() : _size(0), _capacity(1), _topIndex(-1){
     _stack = new T[1];
 }
 
 template<typename T>
 Stack<T>::Stack(const Stack& other) {
     _size = other._size;
+    _capacity = other._capacity;
     _topIndex = other._topIndex;
-    _stack = new T[_size];
-    std::memcpy(_stack, other._stack, sizeof(T) * _size);
+    _stack = new T[_capacity];
+    for (int i = 0; i < _size; i++) {
+        _stack[i] = other._stack[i];
+    }
 }
 
 
@@ -55,15 +63,25 @@ Stack<T>::~Stack() {
     delete[] _stack;
 }
 
+// Capacity is tracked separately from size; elements are moved rather than memcpy'd
+// so that non-trivial types (e.g. std::string members) survive a resize.
+template<typename T>
+void Stack<T>::grow() {
+    T *temp = new T[_capacity * 2];
+    for (int i = 0; i < _size; i++) {
+        temp[i] = std::move(_stack[i]);
+    }
+    delete[] _stack;
+    _stack = temp;
+    _capacity *= 2;
+}
+
 template<typename T>
 void Stack<T>::place(T element) {
-    if (_topIndex == _size - 1) {
-        T *temp = new T[_size * 2];
-        std::memcpy(temp, _stack, sizeof(T) * _size);
-        delete[] _stack;
-        _stack = temp;
+    if (_size == _capacity) {
+        grow();
     }
-    _stack[++_topIndex] = element;
+    _stack[++_topIndex] = std::move(element);
     _size++;
 }
 
@@ -71,11 +89,8 @@ void Stack<T>::place(T element) {
 template<typename T>
 template<typename... Args>
 void Stack<T>::emplace(Args &&... args) {
-    if (_topIndex == _size - 1) {
-        T *temp = new T[_size * 2];
-        std::memcpy(temp, _stack, sizeof(T) * _size);
-        delete[] _stack;
-        _stack = temp;
+    if (_size == _capacity) {
+        grow();
     }
     _stack[++_topIndex] = T(std::forward<Args>(args)...);
     _size++;
@@ -91,10 +106,9 @@ T Stack<T>::pop() {
     return temp;
 }
 
+// Keeps the buffer, so a reused stack stops allocating once it's big enough
 template<typename T>
 void Stack<T>::clear() {
-    delete[] _stack;
-    _stack = new T[1];
     _size = 0;
     _topIndex = -1;
 }
@@ -0,0 +1,140 @@
+#ifndef MATH_MATTERS_C_API_H
+#define MATH_MATTERS_C_API_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libmathmatters: the evaluator without the UI, behind a C API.
+ *
+ *     mm_context *context = mm_context_create();
+ *     float value;
+ *     mm_error error;
+ *     if (mm_evaluate(context, "2 * (3 + 4)", 11, &value, &error) != MM_OK)
+ *         fprintf(stderr, "%s\n", mm_error_message(error.code));
+ *     mm_context_free(context);
+ *
+ * A context belongs to one thread at a time (mm_cancel excepted); use one per
+ * thread. Programs are read-only once compiled and can be shared freely.
+ * Loading the library runs no code and nothing here allocates until asked to.
+ * Statements are bytes plus a length and need not be NUL-terminated.
+ */
+
+#if defined(_WIN32) && defined(MATH_MATTERS_SHARED)
+#  ifdef MATH_MATTERS_BUILD
+#    define MM_API __declspec(dllexport)
+#  else
+#    define MM_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define MM_API __attribute__((visibility("default")))
+#else
+#  define MM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever a declaration below changes incompatibly */
+#define MM_API_VERSION 2
+
+typedef enum mm_status {
+    MM_OK = 0,
+    MM_INVALID_CHARACTERS,
+    MM_UNBALANCED_PARENTHESES,
+    MM_INVALID_OPERATOR,
+    MM_MISSING_OPERATOR,
+    MM_INVALID_NUMBER,
+    MM_EMPTY_EXPRESSION,
+    MM_ZERO_DIVISION,
+    MM_TOO_LONG,
+    MM_INVALID_DEFINITION,
+    MM_UNKNOWN_NAME,
+    MM_BAD_REFERENCE,
+    MM_CYCLIC_DEFINITION,
+    MM_BUDGET_EXCEEDED,
+    MM_INVALID_CALL,
+    /* from the API itself rather than the statement */
+    MM_OUT_OF_MEMORY = 100,
+    MM_INVALID_ARGUMENT,
+    /* anything else that went wrong inside, e.g. a thread that couldn't be started */
+    MM_INTERNAL
+} mm_status;
+
+/* Which limit an MM_BUDGET_EXCEEDED ran into */
+typedef enum mm_limit {
+    MM_LIMIT_NONE = 0,
+    MM_LIMIT_TOKENS,
+    MM_LIMIT_DEPTH,
+    MM_LIMIT_REDUCTIONS,
+    MM_LIMIT_DEADLINE,
+    MM_LIMIT_MAGNITUDE,
+    MM_LIMIT_CANCELLED,
+    MM_LIMIT_STEP_BYTES
+} mm_limit;
+
+/* offset and length are a byte range of the statement as given */
+typedef struct mm_error {
+    int code;
+    size_t offset;
+    size_t length;
+    int limit;
+} mm_error;
+
+/* Zero means no limit, which is what a new context has */
+typedef struct mm_budget {
+    size_t max_tokens;
+    size_t max_depth;
+    size_t max_reductions;
+    uint64_t timeout_ns;
+    float max_magnitude;
+    /* bytes of steps recorded, when mm_record_steps is on */
+    size_t max_step_bytes;
+} mm_budget;
+
+typedef struct mm_context mm_context;
+typedef struct mm_program mm_program;
+
+MM_API int mm_api_version(void);
+
+/* Never NULL; "" for MM_OK */
+MM_API const char *mm_error_message(int code);
+
+/* Contexts. NULL when out of memory. */
+MM_API mm_context *mm_context_create(void);
+MM_API void mm_context_free(mm_context *context);
+
+MM_API void mm_set_budget(mm_context *context, const mm_budget *budget);
+
+/* Safe from any thread. Evaluations on the context stop with MM_LIMIT_CANCELLED
+ * until mm_clear_cancel. */
+MM_API void mm_cancel(mm_context *context);
+MM_API void mm_clear_cancel(mm_context *context);
+
+/* With steps on, mm_evaluate records the steps of statements under the parallel
+ * threshold, at some cost; they're readable until the context's next evaluation.
+ * Off by default. A step is not NUL-terminated; unary minus shows as 'n' or 'm'. */
+MM_API void mm_record_steps(mm_context *context, int enabled);
+MM_API size_t mm_step_count(const mm_context *context);
+MM_API const char *mm_step(const mm_context *context, size_t index, size_t *length);
+
+/* Evaluation. The mm_status is returned and, when error isn't NULL, also filled in
+ * there with where it went wrong. value is left alone on failure. */
+MM_API int mm_evaluate(mm_context *context, const char *statement, size_t length, float *value, mm_error *error);
+
+/* Check and normalize once, evaluate as often as wanted. NULL on failure. */
+MM_API mm_program *mm_compile(const char *statement, size_t length, mm_error *error);
+MM_API int mm_run(mm_context *context, const mm_program *program, float *value, mm_error *error);
+MM_API void mm_program_free(mm_program *program);
+
+/* count statements at once, sharing their common sub-expressions. lengths may be
+ * NULL for NUL-terminated statements, errors may be NULL. A failed statement's
+ * value is NaN. Budgets don't apply. Returns how many failed. */
+MM_API size_t mm_evaluate_batch(mm_context *context, const char *const *statements, const size_t *lengths,
+                                size_t count, float *values, mm_error *errors);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MATH_MATTERS_C_API_H */
@@ -0,0 +1,71 @@
+#include "Arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace psv
+{
+
+Arena::Arena(std::size_t block_size, std::size_t max_retained)
+        : _current(0), _offset(0), _used(0), _block_size(block_size), _max_retained(max_retained) {
+}
+
+void Arena::addBlock(std::size_t size) {
+    _blocks.push_back({std::make_unique<std::byte[]>(size), size});
+}
+
+void *Arena::allocate(std::size_t size, std::size_t alignment) {
+    while (_current < _blocks.size()) {
+        Block &block = _blocks[_current];
+        auto base = reinterpret_cast<std::uintptr_t>(block.data.get());
+        std::size_t aligned = ((base + _offset + alignment - 1) & ~(alignment - 1)) - base;
+        if (aligned + size <= block.size) {
+            _offset = aligned + size;
+            _used += size;
+            return block.data.get() + aligned;
+        }
+        _current++;
+        _offset = 0;
+    }
+    std::size_t last = _blocks.empty() ? 0 : _blocks.back().size;
+    addBlock(std::max({_block_size, last * 2, size + alignment}));
+    return allocate(size, alignment);
+}
+
+std::string_view Arena::copy(std::string_view text) {
+    if (text.empty())
+        return {};
+    auto *data = static_cast<char *>(allocate(text.size(), alignof(char)));
+    std::memcpy(data, text.data(), text.size());
+    return {data, text.size()};
+}
+
+void Arena::reset() {
+    if (_blocks.size() > 1 || (!_blocks.empty() && _blocks.front().size > _max_retained)) {
+        std::size_t total = 0;
+        for (auto const &block : _blocks)
+            total += block.size;
+        _blocks.clear();
+        addBlock(std::min(total, std::max(_max_retained, _block_size)));
+    }
+    _current = 0;
+    _offset = 0;
+    _used = 0;
+}
+
+std::size_t Arena::used() const {
+    return _used;
+}
+
+std::size_t Arena::capacity() const {
+    std::size_t total = 0;
+    for (auto const &block : _blocks)
+        total += block.size;
+    return total;
+}
+
+std::size_t Arena::blocks() const {
+    return _blocks.size();
+}
+
+} // namespace psv
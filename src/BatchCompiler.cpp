@@ -0,0 +1,277 @@
+#include "BatchCompiler.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+
+namespace psv
+{
+
+std::size_t BatchCompiler::NodeHash::operator()(const Node &node) const {
+    std::uint64_t key = (static_cast<std::uint64_t>(node.lhs) << 32) | node.rhs;
+    key ^= static_cast<std::uint64_t>(static_cast<unsigned char>(node.op)) * 0x9E3779B97F4A7C15ull;
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ull;
+    key ^= key >> 32;
+    return static_cast<std::size_t>(key);
+}
+
+BatchCompiler::NodeId BatchCompiler::intern(char op, NodeId lhs, NodeId rhs) {
+    _references++;
+    Node node{op, lhs, rhs};
+    auto found = _interned.find(node);
+    if (found != _interned.end())
+        return found->second;
+    auto id = static_cast<NodeId>(_nodes.size());
+    _nodes.push_back(node);
+    _levels.push_back(op == '#' ? 0 : std::max(_levels[lhs], _levels[rhs]) + 1);
+    _interned.emplace(node, id);
+    return id;
+}
+
+std::size_t BatchCompiler::add(const equation &eq) {
+    Statement statement{};
+    statement.divisions_begin = _divisions.size();
+    statement.error = prepare(eq, _normalized, _origin);
+    if (!statement.error) {
+        Result<NodeId> root = parse();
+        if (root)
+            statement.root = *root;
+        else
+            statement.error = locate(root.error(), _origin, _origin.size(), eq.size());
+    }
+    // Divisions reduced before a parse error are kept: evaluate() would have got
+    // to them first, so one of them failing is the error to report instead
+    statement.divisions_end = _divisions.size();
+    _statements.push_back(statement);
+    return _statements.size() - 1;
+}
+
+// Same precedence handling as shuntingYard in MathProcessor.cpp,
+// except reducing builds (or finds) a node instead of computing a value.
+Result<BatchCompiler::NodeId> BatchCompiler::parse() {
+    Stack<NodeId> output;
+    Stack<Operator> operators;
+    std::size_t number_start = 0;
+    std::size_t number_length = 0;
+    auto pushNumber = [&]() -> Error {
+        const char *number = _normalized.c_str() + number_start;
+        if (std::count(number, number + number_length, '.') > 1 || (number_length == 1 && *number == '.'))
+            return {ErrorCode::InvalidNumber, number_start, number_length};
+        output.place(intern('#', std::bit_cast<NodeId>(std::strtof(number, nullptr)), 0));
+        number_length = 0;
+        return {};
+    };
+
+    for (std::size_t i = 0; i < _normalized.size(); i++) {
+        const char symbol = _normalized[i];
+        if (isdigit(symbol) || symbol == '.') {
+            if (number_length == 0)
+                number_start = i;
+            number_length++;
+            continue;
+        } else if (number_length != 0) {
+            if (Error err = pushNumber())
+                return err;
+        }
+        if (operators.isEmpty() || symbol == '(') {
+            operators.place({symbol, i});
+        } else if (symbol == ')') {
+            while (operators.top().symbol != '(') {
+                if (Error err = reduce(output, operators))
+                    return err;
+            }
+            operators.pop();
+        } else if (symbol == ',') {
+            while (operators.top().symbol != '(') {
+                if (Error err = reduce(output, operators))
+                    return err;
+            }
+        } else {
+            while (!operators.isEmpty() && precedence(operators.top().symbol) >= precedence(symbol)) {
+                if (Error err = reduce(output, operators))
+                    return err;
+            }
+            operators.place({symbol, i});
+        }
+    }
+    if (number_length != 0) {
+        if (Error err = pushNumber())
+            return err;
+    }
+    while (!operators.isEmpty()) {
+        if (Error err = reduce(output, operators))
+            return err;
+    }
+    if (output.size() != 1)
+        return Error{ErrorCode::EmptyExpression, 0, _normalized.size()};
+    return output.pop();
+}
+
+Error BatchCompiler::reduce(Stack<NodeId> &output, Stack<Operator> &operators) {
+    Operator op = operators.pop();
+    if (output.isEmpty())
+        return {ErrorCode::InvalidOperator, op.offset, 1};
+    if (isFunction(op.symbol)) {
+        // a single argument goes in both slots
+        const FunctionInfo &function = functionInfo(op.symbol);
+        NodeId args[max_arity];
+        for (unsigned arg = function.arity; arg-- > 0;) {
+            if (output.isEmpty())
+                return {ErrorCode::InvalidCall, op.offset, 1};
+            args[arg] = output.pop();
+        }
+        NodeId node = intern(op.symbol, args[0], args[function.arity - 1]);
+        if (function.divides)
+            _divisions.push_back({node, _origin[op.offset]});
+        output.place(node);
+        return {};
+    }
+    NodeId b = output.pop();
+    if (isUnary(op.symbol)) {
+        // 'm' only differs from 'n' in precedence, which parsing has already used up
+        output.place(intern('n', b, b));
+        return {};
+    }
+    if (output.isEmpty())
+        return {ErrorCode::InvalidOperator, op.offset, 1};
+    NodeId a = output.pop();
+    // + and * commute exactly in IEEE arithmetic, so a+b and b+a can share a node
+    if ((op.symbol == '+' || op.symbol == '*') && b < a)
+        std::swap(a, b);
+    NodeId node = intern(op.symbol, a, b);
+    if (op.symbol == '/')
+        _divisions.push_back({node, _origin[op.offset]});
+    output.place(node);
+    return {};
+}
+
+std::vector<Result<float>> BatchCompiler::evaluate() const {
+    // Bucket the nodes by level (children are always on a lower level)
+    std::uint32_t depth = 0;
+    for (auto level : _levels)
+        depth = std::max(depth, level + 1);
+    std::vector<std::size_t> level_start(depth + 1);
+    for (auto level : _levels)
+        level_start[level + 1]++;
+    for (std::uint32_t level = 0; level < depth; level++)
+        level_start[level + 1] += level_start[level];
+    std::vector<NodeId> order(_nodes.size());
+    {
+        std::vector<std::size_t> next(level_start.begin(), level_start.end() - 1);
+        for (std::size_t i = 0; i < _nodes.size(); i++)
+            order[next[_levels[i]]++] = static_cast<NodeId>(i);
+    }
+
+    std::vector<float> values(_nodes.size());
+    std::vector<bool> failed(_nodes.size());
+    std::vector<NodeId> powers;
+    std::vector<float> bases;
+    std::vector<float> exponents;
+    std::vector<float> results_column;
+    // Calls on a level, a column of arguments per function
+    std::array<std::vector<NodeId>, function_count> calls;
+    std::array<std::array<std::vector<float>, max_arity>, function_count> arguments;
+    for (std::uint32_t level = 0; level < depth; level++) {
+        for (std::size_t o = level_start[level]; o < level_start[level + 1]; o++) {
+            const NodeId i = order[o];
+            const Node &node = _nodes[i];
+            if (node.op == '#') {
+                values[i] = std::bit_cast<float>(node.lhs);
+            } else if (failed[node.lhs] || failed[node.rhs]) {
+                failed[i] = true;
+            } else if (node.op == 'n') {
+                values[i] = operateUnary(values[node.lhs], 'n');
+            } else if (node.op == '^') {
+                powers.push_back(i);
+                bases.push_back(values[node.lhs]);
+                exponents.push_back(values[node.rhs]);
+            } else if (isFunction(node.op)) {
+                const auto f = static_cast<std::size_t>(functionOf(node.op));
+                if (functions[f].divides && values[node.rhs] == 0) {
+                    failed[i] = true;
+                    continue;
+                }
+                calls[f].push_back(i);
+                arguments[f][0].push_back(values[node.lhs]);
+                arguments[f][1].push_back(values[node.rhs]);
+            } else {
+                Result<float> value = operateBinary(values[node.lhs], values[node.rhs], node.op);
+                if (value)
+                    values[i] = *value;
+                else
+                    failed[i] = true;
+            }
+        }
+        if (!powers.empty()) {
+            results_column.resize(powers.size());
+            powColumn(bases.data(), exponents.data(), results_column.data(), powers.size());
+            for (std::size_t p = 0; p < powers.size(); p++)
+                values[powers[p]] = results_column[p];
+            powers.clear();
+            bases.clear();
+            exponents.clear();
+        }
+        for (std::size_t f = 0; f < function_count; f++) {
+            if (calls[f].empty())
+                continue;
+            results_column.resize(calls[f].size());
+            const float *columns[max_arity] = {arguments[f][0].data(), arguments[f][1].data()};
+            functionColumn(static_cast<Function>(f), columns, results_column.data(), calls[f].size());
+            for (std::size_t c = 0; c < calls[f].size(); c++)
+                values[calls[f][c]] = results_column[c];
+            calls[f].clear();
+            for (auto &column : arguments[f])
+                column.clear();
+        }
+    }
+
+    std::vector<Result<float>> results;
+    results.reserve(_statements.size());
+    for (auto const &statement : _statements) {
+        if (!statement.error && !failed[statement.root]) {
+            results.emplace_back(values[statement.root]);
+        } else {
+            // Only division (and mod) can fail; the first one in this statement that
+            // failed on its own is the one evaluate() would have stopped at, as long
+            // as it was reduced before the parse error, if there is one.
+            Error err = statement.error ? statement.error : Error{ErrorCode::ZeroDivision};
+            for (std::size_t d = statement.divisions_begin; d < statement.divisions_end; d++) {
+                const Node &node = _nodes[_divisions[d].node];
+                if (failed[_divisions[d].node] && !failed[node.lhs] && !failed[node.rhs]) {
+                    err = {ErrorCode::ZeroDivision, _divisions[d].offset, 1};
+                    break;
+                }
+            }
+            results.emplace_back(err);
+        }
+    }
+    return results;
+}
+
+void BatchCompiler::clear() {
+    _nodes.clear();
+    _levels.clear();
+    _interned.clear();
+    _statements.clear();
+    _divisions.clear();
+    _references = 0;
+}
+
+std::size_t BatchCompiler::size() const {
+    return _statements.size();
+}
+
+std::size_t BatchCompiler::nodeCount() const {
+    return _nodes.size();
+}
+
+std::size_t BatchCompiler::referenceCount() const {
+    return _references;
+}
+
+std::size_t BatchCompiler::deduplicated() const {
+    return _references - _nodes.size();
+}
+
+} // namespace psv
@@ -0,0 +1,102 @@
+#include "Budget.h"
+#include <cctype>
+#include <cmath>
+
+namespace psv
+{
+
+const char *limitName(Limit limit) {
+    switch (limit) {
+        case Limit::None:
+            return "none";
+        case Limit::Tokens:
+            return "tokens";
+        case Limit::Depth:
+            return "nesting depth";
+        case Limit::Reductions:
+            return "steps";
+        case Limit::Deadline:
+            return "time";
+        case Limit::Magnitude:
+            return "magnitude";
+        case Limit::Cancelled:
+            return "cancelled";
+        case Limit::StepBytes:
+            return "step memory";
+    }
+    return "";
+}
+
+void Meter::start(const Budget &budget) {
+    _budget = budget;
+    _deadline = std::chrono::steady_clock::now() + budget.timeout;
+    _reductions.store(0, std::memory_order_relaxed);
+    _step_bytes = 0;
+    _exceeded.store(Limit::None, std::memory_order_relaxed);
+}
+
+Error Meter::measure(const std::string &normalized) {
+    if (_budget.max_tokens == 0 && _budget.max_depth == 0)
+        return {};
+    std::size_t tokens = 0;
+    std::size_t depth = 0;
+    bool in_number = false;
+    for (std::size_t i = 0; i < normalized.size(); i++) {
+        const char c = normalized[i];
+        const bool number = std::isdigit(static_cast<unsigned char>(c)) || c == '.';
+        if (!number || !in_number)
+            tokens++;
+        in_number = number;
+        if (c == '(')
+            depth++;
+        else if (c == ')')
+            depth--;
+        if (_budget.max_tokens != 0 && tokens > _budget.max_tokens) {
+            trip(Limit::Tokens);
+            return {ErrorCode::BudgetExceeded, i, normalized.size() - i};
+        }
+        if (_budget.max_depth != 0 && depth > _budget.max_depth) {
+            trip(Limit::Depth);
+            return {ErrorCode::BudgetExceeded, i, 1};
+        }
+    }
+    return {};
+}
+
+Limit Meter::charge(std::size_t reductions) {
+    if (_budget.cancellation != nullptr && _budget.cancellation->cancelled())
+        return trip(Limit::Cancelled);
+    if (_budget.max_reductions != 0 &&
+        _reductions.fetch_add(reductions, std::memory_order_relaxed) + reductions > _budget.max_reductions)
+        return trip(Limit::Reductions);
+    if (_budget.timeout.count() != 0 && std::chrono::steady_clock::now() >= _deadline)
+        return trip(Limit::Deadline);
+    // some other thread on the same evaluation may have run out
+    return _exceeded.load(std::memory_order_relaxed);
+}
+
+Limit Meter::checkMagnitude(float value) {
+    if (_budget.max_magnitude != 0 && std::fabs(value) > _budget.max_magnitude)
+        return trip(Limit::Magnitude);
+    return Limit::None;
+}
+
+Limit Meter::chargeStep(std::size_t bytes) {
+    _step_bytes += bytes;
+    if (_budget.max_step_bytes != 0 && _step_bytes > _budget.max_step_bytes)
+        return trip(Limit::StepBytes);
+    return Limit::None;
+}
+
+Limit Meter::exceeded() const {
+    return _exceeded.load(std::memory_order_relaxed);
+}
+
+// The first limit to trip is the one that gets reported
+Limit Meter::trip(Limit limit) {
+    Limit none = Limit::None;
+    _exceeded.compare_exchange_strong(none, limit, std::memory_order_relaxed);
+    return limit;
+}
+
+} // namespace psv
@@ -0,0 +1,29 @@
+#include "MathProcessor.h"
+#include <stdexcept>
+
+namespace psv
+{
+
+// The one piece of global state, kept out of MathProcessor.cpp so that
+// libmathmatters, which only takes explicit contexts, constructs nothing on load
+static EvaluationContext default_context;
+std::vector<std::string_view> &steps = default_context.steps;
+Budget &budget = default_context.budget;
+
+Result<float> evaluate(const equation& eq) {
+    return evaluate(eq, default_context);
+}
+
+Result<float> evaluateNormalized(const equation& normalized, const std::vector<std::size_t>& origin, std::size_t size) {
+    return evaluateNormalized(normalized, origin, size, default_context);
+}
+
+float nonRpnEvaluate(const equation& eq) {
+    Result<float> result = evaluate(eq);
+    if (!result) {
+        throw std::invalid_argument(errorMessage(result.error().code));
+    }
+    return *result;
+}
+
+} // namespace psv
@@ -0,0 +1,326 @@
+#include "Definitions.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <thread>
+#include "ParallelEvaluator.h"
+
+namespace psv
+{
+
+// A wave smaller than this is evaluated on the calling thread; each definition only
+// takes a microsecond or two, so threads have to have plenty to do to pay for themselves
+static constexpr std::size_t parallel_wave = 256;
+
+static bool isNameStart(char c) {
+    return std::isalpha(static_cast<unsigned char>(c));
+}
+
+static bool isNamePart(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+Error splitDefinition(const std::string &line, std::string &name, std::string &expression) {
+    const std::size_t equals = line.find('=');
+    if (equals == std::string::npos)
+        return {ErrorCode::InvalidDefinition, 0, line.size()};
+    std::size_t begin = 0;
+    while (begin < equals && std::isspace(static_cast<unsigned char>(line[begin])))
+        begin++;
+    std::size_t end = equals;
+    while (end > begin && std::isspace(static_cast<unsigned char>(line[end - 1])))
+        end--;
+    if (begin == end || !isNameStart(line[begin]) ||
+        !std::all_of(line.begin() + static_cast<std::ptrdiff_t>(begin), line.begin() + static_cast<std::ptrdiff_t>(end), isNamePart) ||
+        findFunction(std::string_view(line).substr(begin, end - begin)) != function_count)
+        return {ErrorCode::InvalidDefinition, begin, std::max<std::size_t>(end - begin, 1)};
+    name = line.substr(begin, end - begin);
+    expression = line.substr(equals + 1);
+    return {};
+}
+
+// A value as text evaluate() reads back as exactly the same float
+static std::string literal(float value) {
+    if (std::isnan(value))
+        return "((-1)^0.5)";
+    if (std::isinf(value))
+        return value > 0 ? "(2^128)" : "(-2^128)";
+    // the shortest fixed notation that round-trips; the smallest float needs ~50 characters
+    char buffer[64];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed).ptr;
+    return "(" + std::string(buffer, end) + ")";
+}
+
+// evaluateParallel(text, 1), charged to a Meter of its own; errors are into text
+static Result<float> evaluateWithin(const std::string &text, const Budget &budget) {
+    equation normalized;
+    std::vector<std::size_t> origin;
+    if (Error err = prepare(text, normalized, origin))
+        return err;
+    Meter meter;
+    meter.start(budget);
+    Error err = meter.measure(normalized);
+    Result<float> result = err ? Result<float>(err) : evaluatePrepared(normalized, 1, parallel_threshold, &meter);
+    if (!result)
+        return locate(result.error(), origin, origin.size(), text.size());
+    return result;
+}
+
+Error Definitions::define(const std::string &line) {
+    std::string name;
+    std::string expression;
+    if (Error err = splitDefinition(line, name, expression))
+        return err;
+    define(name, expression);
+    return {};
+}
+
+void Definitions::define(const std::string &name, const std::string &expression) {
+    const NodeId id = node(name);
+    if (_nodes[id].defined && _nodes[id].expression == expression)
+        return;
+    if (!_nodes[id].defined) {
+        _nodes[id].defined = true;
+        _defined++;
+    }
+    _nodes[id].expression = expression;
+    unlink(id);
+
+    // node() can add to _nodes, so no references into it across the loop
+    std::vector<Reference> references;
+    for (std::size_t i = 0; i < expression.size(); i++) {
+        if (!isNameStart(expression[i]))
+            continue;
+        std::size_t length = 1;
+        while (i + length < expression.size() && isNamePart(expression[i + length]))
+            length++;
+        // sqrt(...) is a call, not a name
+        std::size_t after = i + length;
+        while (after < expression.size() && std::isspace(static_cast<unsigned char>(expression[after])))
+            after++;
+        if (after < expression.size() && expression[after] == '(' &&
+            findFunction(std::string_view(expression).substr(i, length)) != function_count) {
+            i += length - 1;
+            continue;
+        }
+        references.push_back({node(expression.substr(i, length)), i, length});
+        i += length - 1;
+    }
+    Node &defined = _nodes[id];
+    defined.references = std::move(references);
+    for (const auto &reference : defined.references) {
+        if (std::find(defined.dependencies.begin(), defined.dependencies.end(), reference.node) == defined.dependencies.end())
+            defined.dependencies.push_back(reference.node);
+    }
+    for (NodeId dependency : defined.dependencies)
+        _nodes[dependency].dependents.push_back(id);
+    markDirty(id);
+}
+
+void Definitions::remove(const std::string &name) {
+    auto found = _ids.find(name);
+    if (found == _ids.end() || !_nodes[found->second].defined)
+        return;
+    Node &removed = _nodes[found->second];
+    removed.defined = false;
+    removed.expression.clear();
+    _defined--;
+    unlink(found->second);
+    // anything still using the name now has an unknown name in it
+    markDirty(found->second);
+}
+
+void Definitions::clear() {
+    _nodes.clear();
+    _ids.clear();
+    _dirty.clear();
+    _defined = 0;
+}
+
+Definitions::NodeId Definitions::node(const std::string &name) {
+    auto found = _ids.find(name);
+    if (found != _ids.end())
+        return found->second;
+    const auto id = static_cast<NodeId>(_nodes.size());
+    _nodes.push_back({});
+    _nodes.back().name = name;
+    _ids.emplace(name, id);
+    return id;
+}
+
+// Forget what id depends on (but not what depends on id)
+void Definitions::unlink(NodeId id) {
+    for (NodeId dependency : _nodes[id].dependencies) {
+        auto &dependents = _nodes[dependency].dependents;
+        dependents.erase(std::find(dependents.begin(), dependents.end(), id));
+    }
+    _nodes[id].dependencies.clear();
+    _nodes[id].references.clear();
+}
+
+// id and everything downstream of it. Whatever is downstream of a dirty node is
+// already dirty, so the walk stops at the first dirty node on each path.
+void Definitions::markDirty(NodeId id) {
+    std::vector<NodeId> pending = {id};
+    while (!pending.empty()) {
+        const NodeId next = pending.back();
+        pending.pop_back();
+        if (_nodes[next].dirty)
+            continue;
+        _nodes[next].dirty = true;
+        _dirty.push_back(next);
+        pending.insert(pending.end(), _nodes[next].dependents.begin(), _nodes[next].dependents.end());
+    }
+}
+
+std::size_t Definitions::update(unsigned threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Names that are used but not defined have nothing to compute
+    for (NodeId id : _dirty) {
+        if (!_nodes[id].defined) {
+            _nodes[id].value = Error{ErrorCode::UnknownName};
+            _nodes[id].dirty = false;
+        }
+    }
+
+    // Kahn's algorithm over just the dirty part of the graph
+    std::vector<NodeId> wave;
+    for (NodeId id : _dirty) {
+        Node &dirty = _nodes[id];
+        if (!dirty.dirty)
+            continue;
+        dirty.waiting = 0;
+        for (NodeId dependency : dirty.dependencies)
+            dirty.waiting += _nodes[dependency].dirty;
+        if (dirty.waiting == 0)
+            wave.push_back(id);
+    }
+
+    std::size_t computed = 0;
+    std::vector<NodeId> next;
+    while (!wave.empty()) {
+        // Nothing in a wave depends on anything else in it
+        auto run = [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++)
+                _nodes[wave[i]].value = compute(_nodes[wave[i]]);
+        };
+        const std::size_t chunks = wave.size() < parallel_wave ? 1 : std::min<std::size_t>(threads, wave.size() / (parallel_wave / 4));
+        std::vector<std::thread> workers;
+        for (std::size_t chunk = 1; chunk < chunks; chunk++)
+            workers.emplace_back(run, wave.size() * chunk / chunks, wave.size() * (chunk + 1) / chunks);
+        run(0, wave.size() / chunks);
+        for (auto &worker : workers)
+            worker.join();
+        computed += wave.size();
+
+        next.clear();
+        for (NodeId id : wave)
+            _nodes[id].dirty = false;
+        for (NodeId id : wave) {
+            for (NodeId dependent : _nodes[id].dependents) {
+                if (_nodes[dependent].dirty && --_nodes[dependent].waiting == 0)
+                    next.push_back(dependent);
+            }
+        }
+        std::swap(wave, next);
+    }
+
+    // Whatever is still dirty is on a cycle, or downstream of one
+    for (NodeId id : _dirty) {
+        Node &stuck = _nodes[id];
+        if (stuck.dirty) {
+            stuck.value = Error{ErrorCode::CyclicDefinition, 0, stuck.expression.size()};
+            stuck.dirty = false;
+        }
+    }
+    _dirty.clear();
+    return computed;
+}
+
+// The expression with every name replaced by its value, evaluated, and any error
+// moved back onto the expression as written
+Result<float> Definitions::compute(const Node &node) const {
+    if (node.references.empty())
+        return evaluateWithin(node.expression, _budget);
+
+    std::string text;
+    std::vector<std::size_t> origin;
+    std::size_t copied = 0;
+    auto copy = [&](std::size_t end) {
+        for (; copied < end; copied++) {
+            text += node.expression[copied];
+            origin.push_back(copied);
+        }
+    };
+    for (const auto &reference : node.references) {
+        copy(reference.offset);
+        const Node &target = _nodes[reference.node];
+        if (!target.defined)
+            return Error{ErrorCode::UnknownName, reference.offset, reference.length};
+        if (!target.value)
+            return Error{ErrorCode::BadReference, reference.offset, reference.length};
+        const std::string value = literal(*target.value);
+        text += value;
+        origin.insert(origin.end(), value.size(), reference.offset);
+        copied += reference.length;
+    }
+    copy(node.expression.size());
+
+    Result<float> result = evaluateWithin(text, _budget);
+    if (!result)
+        return locate(result.error(), origin, origin.size(), node.expression.size());
+    return result;
+}
+
+void Definitions::setBudget(const Budget &budget) {
+    _budget = budget;
+    for (NodeId id = 0; id < _nodes.size(); id++) {
+        if (_nodes[id].defined)
+            markDirty(id);
+    }
+}
+
+const Budget &Definitions::budget() const {
+    return _budget;
+}
+
+bool Definitions::contains(const std::string &name) const {
+    auto found = _ids.find(name);
+    return found != _ids.end() && _nodes[found->second].defined;
+}
+
+Result<float> Definitions::value(const std::string &name) const {
+    auto found = _ids.find(name);
+    if (found == _ids.end() || !_nodes[found->second].defined)
+        return Error{ErrorCode::UnknownName};
+    return _nodes[found->second].value;
+}
+
+const std::string &Definitions::expression(const std::string &name) const {
+    static const std::string none;
+    auto found = _ids.find(name);
+    return found == _ids.end() ? none : _nodes[found->second].expression;
+}
+
+std::vector<std::string> Definitions::names() const {
+    std::vector<std::string> defined;
+    defined.reserve(_defined);
+    for (const auto &node : _nodes) {
+        if (node.defined)
+            defined.push_back(node.name);
+    }
+    return defined;
+}
+
+std::size_t Definitions::size() const {
+    return _defined;
+}
+
+std::size_t Definitions::dirtyCount() const {
+    return static_cast<std::size_t>(std::count_if(_dirty.begin(), _dirty.end(),
+                                                  [this](NodeId id) { return _nodes[id].defined; }));
+}
+
+} // namespace psv
@@ -0,0 +1,250 @@
+#include "FastMath.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+
+namespace psv
+{
+
+// Lanes are independent accumulators; each one only ever adds to itself, so the
+// loop vectorizes without the compiler having to reassociate anything.
+double pairwiseSum(const double *terms, std::size_t count) {
+    if (count > pairwise_block) {
+        const std::size_t half = count / 2;
+        return pairwiseSum(terms, half) + pairwiseSum(terms + half, count - half);
+    }
+    double lanes[4] = {0, 0, 0, 0};
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (std::size_t lane = 0; lane < 4; lane++)
+            lanes[lane] += terms[i + lane];
+    }
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++)
+        sum += terms[i];
+    return sum;
+}
+
+double pairwiseProduct(const double *factors, std::size_t count) {
+    if (count > pairwise_block) {
+        const std::size_t half = count / 2;
+        return pairwiseProduct(factors, half) * pairwiseProduct(factors + half, count - half);
+    }
+    double lanes[4] = {1, 1, 1, 1};
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (std::size_t lane = 0; lane < 4; lane++)
+            lanes[lane] *= factors[i + lane];
+    }
+    double product = (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]);
+    for (; i < count; i++)
+        product *= factors[i];
+    return product;
+}
+
+namespace
+{
+    // A parenthesis, call or the whole statement that evaluateFastMath() is inside
+    // of, and how far it got: where its chains start in the chain buffer and what's
+    // waiting on the value being read
+    struct Group {
+        std::size_t sum_start;
+        std::size_t product_start;
+        // a call's arguments so far, also in the chain buffer
+        std::size_t args_start;
+        char function;
+        std::size_t function_offset;
+        bool subtract;
+        bool divide;
+        std::size_t divide_offset;
+        // the power chain so far, when the value being read is an exponent
+        bool have_base;
+        double base;
+        std::size_t power_offset;
+        // odd numbers of 'n' before the factor / 'm' before the operand
+        bool negate_factor;
+        bool negate_operand;
+    };
+
+    // What evaluateGroups() works in, kept per thread so that, once warmed up,
+    // evaluating doesn't touch the heap: the terms of the chains it has open, and
+    // the groups they're in
+    struct FastMathContext {
+        std::vector<double> chain;
+        std::vector<Group> groups;
+    };
+
+    thread_local FastMathContext scratch;
+
+    Group openGroup(std::size_t chain_size, char function = 0, std::size_t offset = 0) {
+        Group group{};
+        group.sum_start = group.product_start = group.args_start = chain_size;
+        group.function = function;
+        group.function_offset = offset;
+        return group;
+    }
+
+    // The number at position, which moves past it
+    Result<double> readNumber(const equation &eq, std::size_t &position) {
+        const std::size_t start = position;
+        while (position < eq.size() && (isdigit(eq[position]) || eq[position] == '.'))
+            position++;
+        const char *number = eq.c_str() + start;
+        const std::size_t length = position - start;
+        if (std::count(number, number + length, '.') > 1 || (length == 1 && *number == '.'))
+            return Error{ErrorCode::InvalidNumber, start, length};
+        // from_chars rounds exactly like strtof, minus the locale lookups, but
+        // leaves value alone when it's out of range, where strtof gives inf or 0
+        float value = 0;
+        if (std::from_chars(number, number + length, value).ec != std::errc())
+            value = std::strtof(number, nullptr);
+        return static_cast<double>(value);
+    }
+
+    // One pass over a prepared statement, left to right. Precedence levels are
+    // state in the innermost group rather than functions calling each other, and a
+    // parenthesis or call opens a group instead of recursing, so nesting is only
+    // limited by memory, as with evaluate(). Each chain's terms go on the chain
+    // buffer above those of the chains around it and come off once it's reduced.
+    //   sum      := product (('+' | '-') product)*
+    //   product  := factor (('*' | '/') factor)*
+    //   factor   := 'n'* operand ('^' operand)*      (-2^2 is -(2^2); '^' is left associative)
+    //   operand  := 'm'* (number | '(' sum ')' | function '(' sum (',' sum)* ')')
+    Result<double> evaluateGroups(const equation &eq, FastMathContext &fast, Meter &meter) {
+        std::vector<double> &chain = fast.chain;
+        std::vector<Group> &groups = fast.groups;
+        // An operator is a reduction, as in evaluate()
+        auto charge = [&](std::size_t offset) -> Error {
+            if (meter.charge() != Limit::None)
+                return {ErrorCode::BudgetExceeded, offset, 1};
+            return {};
+        };
+        chain.clear();
+        groups.clear();
+        groups.push_back(openGroup(0));
+        std::size_t position = 0;
+        while (true) {
+            // The start of an operand, or of a factor when there's no base yet
+            Group &reading = groups.back();
+            for (; !reading.have_base && eq[position] == 'n'; position++) {
+                if (Error err = charge(position))
+                    return err;
+                reading.negate_factor = !reading.negate_factor;
+            }
+            for (; eq[position] == 'm'; position++) {
+                if (Error err = charge(position))
+                    return err;
+                reading.negate_operand = !reading.negate_operand;
+            }
+            if (isFunction(eq[position])) {
+                if (Error err = charge(position))
+                    return err;
+                groups.push_back(openGroup(chain.size(), eq[position], position));
+                position += 2; // name and '('
+                continue;
+            }
+            if (eq[position] == '(') {
+                groups.push_back(openGroup(chain.size()));
+                position++;
+                continue;
+            }
+            Result<double> operand = readNumber(eq, position);
+            if (!operand)
+                return operand;
+            double value = *operand;
+
+            // Hand the value to the group it's in, closing every group it finishes
+            while (true) {
+                Group &group = groups.back();
+                if (group.negate_operand)
+                    value = -value;
+                group.negate_operand = false;
+                if (group.have_base) {
+                    value = power(static_cast<float>(group.base), static_cast<float>(value));
+                    if (meter.checkMagnitude(static_cast<float>(value)) != Limit::None)
+                        return Error{ErrorCode::BudgetExceeded, group.power_offset, 1};
+                }
+                if (eq[position] == '^') {
+                    if (Error err = charge(position))
+                        return err;
+                    group.power_offset = position;
+                    group.have_base = true;
+                    group.base = value;
+                    position++;
+                    break;
+                }
+                group.have_base = false;
+                if (group.negate_factor)
+                    value = -value;
+                group.negate_factor = false;
+                if (group.divide) {
+                    if (value == 0)
+                        return Error{ErrorCode::ZeroDivision, group.divide_offset, 1};
+                    value = 1 / value;
+                }
+                chain.push_back(value);
+                if (eq[position] == '*' || eq[position] == '/') {
+                    if (Error err = charge(position))
+                        return err;
+                    group.divide = eq[position] == '/';
+                    group.divide_offset = position++;
+                    break;
+                }
+                group.divide = false;
+                const double term = pairwiseProduct(chain.data() + group.product_start,
+                                                    chain.size() - group.product_start);
+                chain.resize(group.product_start);
+                chain.push_back(group.subtract ? -term : term);
+                if (eq[position] == '+' || eq[position] == '-') {
+                    if (Error err = charge(position))
+                        return err;
+                    group.subtract = eq[position++] == '-';
+                    group.product_start = chain.size();
+                    break;
+                }
+                value = pairwiseSum(chain.data() + group.sum_start, chain.size() - group.sum_start);
+                chain.resize(group.sum_start);
+                if (groups.size() == 1)
+                    return value;
+                if (group.function) {
+                    // the kernels are float, like everywhere else
+                    chain.push_back(static_cast<float>(value));
+                    if (eq[position++] == ',') {
+                        group.sum_start = group.product_start = chain.size();
+                        group.subtract = false;
+                        break;
+                    }
+                    float args[max_arity];
+                    std::copy(chain.begin() + static_cast<std::ptrdiff_t>(group.args_start), chain.end(), args);
+                    chain.resize(group.args_start);
+                    Result<float> result = applyFunction(group.function, args);
+                    if (!result)
+                        return Error{result.error().code, group.function_offset, 1};
+                    value = *result;
+                } else {
+                    position++; // ')'
+                }
+                groups.pop_back();
+            }
+        }
+    }
+}
+
+Result<float> evaluateFastMath(const equation &eq, EvaluationContext &context) {
+    context.meter.start(context.budget);
+    if (Error err = prepare(eq, context.normalized, context.origin))
+        return err;
+    if (Error err = context.meter.measure(context.normalized))
+        return locate(err, context.origin, context.origin.size(), eq.size());
+    Result<double> value = evaluateGroups(context.normalized, scratch, context.meter);
+    if (!value)
+        return locate(value.error(), context.origin, context.origin.size(), eq.size());
+    return static_cast<float>(*value);
+}
+
+Result<float> evaluateFastMath(const equation &eq) {
+    thread_local EvaluationContext context;
+    return evaluateFastMath(eq, context);
+}
+
+} // namespace psv
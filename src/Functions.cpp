@@ -0,0 +1,64 @@
+#include "Functions.h"
+
+namespace psv
+{
+
+// One plain loop per kernel, so each one vectorizes on its own terms. Needs
+// -fno-trapping-math and -fno-math-errno (see CMakeLists.txt), otherwise GCC
+// won't if-convert the selects or turn std::sqrt into a vector instruction.
+template<typename Kernel>
+static void unaryColumn(const float *in, float *out, std::size_t count, Kernel kernel) {
+    for (std::size_t i = 0; i < count; i++)
+        out[i] = kernel(in[i]);
+}
+
+template<typename Kernel>
+static void binaryColumn(const float *a, const float *b, float *out, std::size_t count, Kernel kernel) {
+    for (std::size_t i = 0; i < count; i++)
+        out[i] = kernel(a[i], b[i]);
+}
+
+// Like powColumn: everything takes the fast path, then the few elements out of its
+// range are redone with the scalar function, which falls back to libm for them
+template<float (*Scalar)(float)>
+static void trigColumn(const float *in, float *out, std::size_t count, unsigned quarter) {
+    std::size_t others = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        out[i] = reducedSine(in[i], quarter);
+        others += !(std::fabs(in[i]) <= trig_reduction_limit);
+    }
+    if (others == 0)
+        return;
+    for (std::size_t i = 0; i < count; i++) {
+        if (!(std::fabs(in[i]) <= trig_reduction_limit))
+            out[i] = Scalar(in[i]);
+    }
+}
+
+void functionColumn(Function function, const float *const *args, float *out, std::size_t count) {
+    switch (function) {
+        case Function::Sqrt:
+            return unaryColumn(args[0], out, count, squareRoot);
+        case Function::Abs:
+            return unaryColumn(args[0], out, count, absolute);
+        case Function::Min:
+            return binaryColumn(args[0], args[1], out, count, minimum);
+        case Function::Max:
+            return binaryColumn(args[0], args[1], out, count, maximum);
+        case Function::Log:
+            return unaryColumn(args[0], out, count, naturalLog);
+        case Function::Exp:
+            return unaryColumn(args[0], out, count, exponential);
+        case Function::Sin:
+            return trigColumn<sine>(args[0], out, count, 0);
+        case Function::Cos:
+            return trigColumn<cosine>(args[0], out, count, 1);
+        case Function::Floor:
+            return unaryColumn(args[0], out, count, floorOf);
+        case Function::Mod:
+            // fmod is exact, and nothing branch-free is, so this one stays scalar
+            return binaryColumn(args[0], args[1], out, count, modulo);
+    }
+}
+
+} // namespace psv
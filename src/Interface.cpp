@@ -0,0 +1,491 @@
+#include "Interface.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <limits>
+#include <spdlog/spdlog.h>
+#include "ftxui/dom/elements.hpp"
+
+namespace psv
+{
+
+// Rows each step takes up in the Steps view: the step, the step after it, a gap
+constexpr int rows_per_step = 3;
+// Steps built past the bottom of the window, so one that's partly visible still shows
+constexpr int step_margin = 1;
+// Most recent statements the History tab lists
+constexpr std::size_t history_size = 200;
+
+// 'n' and 'm' (unary minus) back to '-', leaving the function names alone
+static void showMinus(std::string& step) {
+    for (std::size_t j = 0; j < step.size(); j++) {
+        std::size_t end = j;
+        while (end < step.size() && std::isalpha(static_cast<unsigned char>(step[end])))
+            end++;
+        if (end > j && findFunction(std::string_view(step).substr(j, end - j)) != function_count)
+            j = end - 1;
+        else if (step[j] == 'n' || step[j] == 'm')
+            step[j] = '-';
+    }
+}
+
+// Step i with the part about to be reduced struck through in red, then (unless it's
+// the last) step i + 1 dimmed with the result of that reduction in green
+static ftxui::Elements renderStep(std::size_t i, bool last) {
+    using namespace ftxui;
+    Elements step_children;
+    std::string current_step(steps[i]);
+    std::string next_step(steps[i + 1]);
+    showMinus(current_step);
+    showMinus(next_step);
+
+    std::string before_diff;
+    std::string diff;
+    std::string after_diff;
+
+    int dif_start = 0;
+    int diff_end = 0;
+    for (int j = 0; j < next_step.size(); j++) {
+        if (current_step[j] != next_step[j]) {
+            dif_start = j;
+            break;
+        }
+    }
+    for (int j = 1; j < next_step.size(); j++) {
+        if (current_step[current_step.size() - j] != next_step[next_step.size() - j]) {
+            diff_end = current_step.size() - j;
+            break;
+        }
+    }
+    before_diff = current_step.substr(0, dif_start);
+    diff = current_step.substr(dif_start, diff_end - dif_start + 1);
+    after_diff = current_step.substr(diff_end + 1, current_step.size());
+
+    std::string next_before_diff = next_step.substr(0, dif_start);
+    std::string next_diff;
+    int z = 0;
+    while(!isOperator(next_step[dif_start + z]) && (dif_start + z) < next_step.size() &&
+    next_step[dif_start + z] != ')'){
+        next_diff += next_step[z+dif_start];
+        z++;
+    }
+    std::string next_after_diff = next_step.substr(dif_start + z, next_step.size());
+
+    // Current step with diff to next in red
+    step_children.push_back(hbox({
+            text(before_diff),
+            text(diff) | strikethrough | color(Color::Red),
+            text(after_diff),
+        }) | hcenter);
+    if(!last){
+        // Next step with diff to previous in green
+        step_children.push_back(hbox({
+                text(next_before_diff),
+                text(next_diff) | color(Color::Green),
+                text(next_after_diff),
+            }) | dim | hcenter);
+    }
+    step_children.push_back(hbox({
+        text(" ")
+        }) | hcenter);
+    return step_children;
+}
+
+Interface::Interface(std::function<int()> rows, ResultStore *store) : _rows(std::move(rows)), _store(store) {
+    using namespace ftxui;
+
+    // Evaluation happens on every keystroke, so nothing typed or pasted may stall it
+    // (the steps of a long statement are far bigger than the statement, hence their
+    // own limit); an overflowing '^' is reported rather than shown as inf
+    budget.max_depth = 256;
+    budget.max_reductions = 1 << 17;
+    budget.max_step_bytes = 8 << 20;
+    budget.timeout = std::chrono::milliseconds(250);
+    budget.max_magnitude = std::numeric_limits<float>::max();
+    // and so is every definition, on every edit of the Definitions tab
+    _definitions.setBudget(budget);
+
+    InputOption input_statement_option;
+    input_statement_option.on_change = [this] { evaluateStatement(); };
+    input_statement_option.on_enter = [this] {
+        _reveal_answer = _valid_input;
+        remember();
+    };
+    _input_statement = Input(&_statement, "Enter a Statement", input_statement_option);
+
+    _button_evaluate = Button("Evaluate", [this] {
+        _reveal_answer = _valid_input;
+        remember();
+        spdlog::get("step_logger")->info("Statement: " + _statement);
+        for(auto const& step : steps) {
+            spdlog::get("step_logger")->info(step);
+        }
+        spdlog::get("step_logger")->info("\n");
+    }, ButtonOption::Ascii());
+
+    _button_reset = Button("Reset", [this] {
+        _statement = "";
+        _result = 0;
+        _result_string = "";
+        _reveal_answer = false;
+        _valid_input = true;
+        _anything_entered = false;
+        steps.clear();
+        _step_offset = 0;
+        _warning_msg.clear();
+        _error_at = {};
+    }, ButtonOption::Ascii());
+
+    auto document_main = Container::Vertical({
+                                                _input_statement,
+                                                _button_evaluate | Maybe([this] { return !_reveal_answer; }),
+                                                _button_reset | Maybe(&_reveal_answer),
+                                        });
+
+    _steps = Renderer([this] { return renderSteps(); });
+
+    auto math_matters = Renderer(document_main, [this] { return renderSolver(); });
+
+    // Page through the steps; the Steps renderer clamps the far end
+    math_matters |= CatchEvent([this](Event event) {
+        if (event == Event::PageDown) {
+            _step_offset += visibleSteps();
+        } else if (event == Event::PageUp) {
+            _step_offset = std::max(0, _step_offset - visibleSteps());
+        } else if (event.is_mouse() && event.mouse().button == Mouse::WheelDown) {
+            _step_offset++;
+        } else if (event.is_mouse() && event.mouse().button == Mouse::WheelUp) {
+            _step_offset = std::max(0, _step_offset - 1);
+        } else {
+            return false;
+        }
+        return true;
+    });
+
+    _toggle_steps = Checkbox("Show Steps?", &_show_steps);
+    _toggle_warnings = Checkbox("Show Warnings?", &_show_warnings);
+
+    auto document_settings = Container::Vertical({
+        _toggle_steps,
+        _toggle_warnings,
+    });
+    auto settings_help = Renderer(document_settings, [this] {
+        return vbox({
+            filler(),
+            vbox({
+                 text("Settings") | bold | hcenter,
+                 _toggle_steps->Render(),
+                 _toggle_warnings->Render(),
+            }) | hcenter,
+            filler(),
+        });
+    });
+
+    InputOption input_definitions_option;
+    input_definitions_option.multiline = true;
+    input_definitions_option.on_change = [this] { updateDefinitions(); };
+    _input_definitions = Input(&_definitions_text, "a = 3*4", input_definitions_option);
+
+    auto definitions_view = Renderer(_input_definitions, [this] { return renderDefinitions(); });
+
+    MenuOption history_option;
+    history_option.on_enter = [this] { recall(); };
+    _history_menu = Menu(&_history_labels, &_history_selected, history_option);
+
+    auto history_view = Renderer(_history_menu, [this] { return renderHistory(); });
+
+    _tab_selection = Menu(&_tabs, &_tab_index, MenuOption::HorizontalAnimated());
+    _tab_content = Container::Tab({
+        math_matters,
+        definitions_view,
+        history_view,
+        settings_help,
+    },
+    &_tab_index);
+
+    auto document = Container::Vertical({
+        _tab_selection,
+        _tab_content,
+    });
+
+    _root = Renderer(document, [this] {
+        return vbox({
+            text("Math-Matters") | bold,
+            _tab_selection->Render(),
+            _tab_content->Render() | flex,
+            text("by Peter V.")
+        });
+    });
+}
+
+ftxui::Component Interface::component() const {
+    return _root;
+}
+
+// As many steps as fit under the rest of the Statement Solver tab
+int Interface::visibleSteps() const {
+    return std::max(1, (_rows() - 14) / rows_per_step);
+}
+
+void Interface::evaluateStatement() {
+    _anything_entered = true;
+    _step_offset = 0;
+    if(_statement.size() < 2)
+        return;
+    // Prepared once, for the store's key and for evaluating. Evaluated in this or an
+    // earlier session: the result and steps are kept.
+    const Error invalid = prepare(_statement, _normalized, _origin);
+    if (invalid)
+        steps.clear();
+    float recalled = 0;
+    const bool kept = !invalid && _store && _store->find(_normalized, recalled, _recalled_steps, steps);
+    Result<float> evaluation = invalid ? Result<float>(invalid) : kept ? Result<float>(recalled)
+                             : evaluateNormalized(_normalized, _origin, _statement.size());
+    if (evaluation) {
+        _result_stream.str(std::string());
+        _result = *evaluation;
+        _result_stream << std::fixed << std::setprecision(1) << _result;
+        _result_string = _result_stream.str();
+        _valid_input = true;
+        _warning_msg.clear();
+        _error_at = {};
+        spdlog::get("basic_logger")->info(kept ? _result_string + " (from the store)" : _result_string);
+    } else {
+        _valid_input = false;
+        _reveal_answer = false;
+        _error_at = evaluation.error();
+        _warning_msg = errorMessage(_error_at.code);
+        spdlog::get("basic_logger")->error("{} (at {})", _warning_msg, _error_at.offset);
+    }
+}
+
+// Keep what was just evaluated for later sessions (and the History tab)
+void Interface::remember() {
+    // _normalized is still the statement's, from evaluateStatement()
+    if (!_store || !_valid_input || _statement.size() < 2)
+        return;
+    _store->store(_normalized, _statement, _result, &steps);
+}
+
+// Back to the Statement Solver with the History entry picked
+void Interface::recall() {
+    if (_history_selected < 0 || _history_selected >= static_cast<int>(_history.size()))
+        return;
+    _statement = _history[_history_selected].statement;
+    evaluateStatement();
+    _reveal_answer = _valid_input;
+    _tab_index = 0;
+}
+
+void Interface::updateDefinitions() {
+    _definition_lines.clear();
+    std::vector<std::string> seen;
+    std::istringstream lines(_definitions_text);
+    std::string line;
+    std::string name;
+    std::string expression;
+    while (std::getline(lines, line)) {
+        if (line.find_first_not_of(" \t") == std::string::npos)
+            continue;
+        Error err = splitDefinition(line, name, expression);
+        if (!err) {
+            _definitions.define(name, expression);
+            seen.push_back(name);
+        }
+        _definition_lines.push_back({err ? line : name, err});
+    }
+    // Deleting (or renaming) a line takes its definition with it
+    for (auto const& defined : _definitions.names()) {
+        if (std::find(seen.begin(), seen.end(), defined) == seen.end())
+            _definitions.remove(defined);
+    }
+    std::size_t recomputed = _definitions.update();
+    spdlog::get("basic_logger")->info("Definitions: recomputed {} of {}", recomputed, _definitions.size());
+}
+
+// Read the store again only when something has been stored since, by anyone
+void Interface::refreshHistory() {
+    const std::uint64_t version = _store->version();
+    if (version == _history_version)
+        return;
+    _history_version = version;
+    _history = _store->history(history_size);
+    _history_labels.clear();
+    for (auto const& entry : _history) {
+        const std::time_t time = entry.time;
+        std::ostringstream label;
+        label << std::put_time(std::localtime(&time), "%b %d %H:%M") << "  " << entry.statement << " = "
+              << std::fixed << std::setprecision(1) << entry.value;
+        _history_labels.push_back(label.str());
+    }
+    _history_selected = std::clamp(_history_selected, 0, std::max(0, static_cast<int>(_history.size()) - 1));
+}
+
+ftxui::Element Interface::renderSteps() {
+    using namespace ftxui;
+    if(!_show_steps || !_reveal_answer) {
+        return vbox({});
+    }
+    // Only the steps in the window (and a margin below it) are built, so a frame
+    // costs the same with ten steps as with ten thousand
+    const int count = steps.empty() ? 0 : static_cast<int>(steps.size()) - 1;
+    const int visible = visibleSteps();
+    _step_offset = std::clamp(_step_offset, 0, std::max(0, count - visible));
+    const int last = std::min(count, _step_offset + visible + step_margin);
+    Elements step_children; // haha
+    for (int i = _step_offset; i < last; i++) {
+        for (auto& element : renderStep(i, i + 1 == count)) {
+            step_children.push_back(std::move(element));
+        }
+    }
+    std::string heading = "Steps:";
+    if (count > visible) {
+        heading = "Steps " + std::to_string(_step_offset + 1) + "-" +
+                  std::to_string(std::min(count, _step_offset + visible)) + " of " +
+                  std::to_string(count) + " (PgUp/PgDn)";
+    }
+    return vbox({
+        text(heading) | dim ,
+        vbox(step_children) | yframe | size(HEIGHT, LESS_THAN, visible * rows_per_step),
+    });
+}
+
+ftxui::Element Interface::renderSolver() {
+    using namespace ftxui;
+    auto result_conditional = _reveal_answer ? hbox({
+        text("=") | bold,
+        text(_result_string) | bold,
+    }) | vcenter : hbox({});
+
+    // Echo the statement with the offending part highlighted
+    Element error_location = hbox({});
+    if (_error_at) {
+        std::size_t begin = std::min(_error_at.offset, _statement.size());
+        std::size_t length = std::min(std::max<std::size_t>(_error_at.length, 1), _statement.size() + 1 - begin);
+        std::string marked = begin < _statement.size() ? _statement.substr(begin, length) : " ";
+        error_location = hbox({
+            text(_statement.substr(0, begin)),
+            text(marked) | inverted | color(Color::Red),
+            text(begin + length < _statement.size() ? _statement.substr(begin + length) : ""),
+        }) | hcenter;
+    }
+
+    auto warnings = _show_warnings ? vbox({
+        error_location,
+        text(_warning_msg) | color(Color::Red) | hcenter,
+    }) | center : hbox({});
+
+
+    return vbox({
+        filler(),
+        hbox({
+            _input_statement->Render() | flex_shrink | border,
+        }) | vcenter | hcenter,
+        _steps->Render() | hcenter,
+        result_conditional | hcenter,
+        warnings,
+        hbox({
+            _reveal_answer ? _button_reset->Render()
+            : _button_evaluate->Render() | (_valid_input ? color(Color::Green) : color(Color::Red)),
+        }) | vcenter | hcenter ,
+        filler(),
+    });
+}
+
+ftxui::Element Interface::renderDefinitions() {
+    using namespace ftxui;
+    // Just the headline of an error message, e.g. "Unknown Name"
+    auto shortError = [](ErrorCode code) {
+        std::string message = errorMessage(code);
+        return message.substr(0, message.find(':'));
+    };
+    Elements rows;
+    for (auto const& line : _definition_lines) {
+        if (line.error) {
+            rows.push_back(hbox({
+                text(line.label) | dim,
+                text("  " + shortError(line.error.code)) | color(Color::Red),
+            }));
+            continue;
+        }
+        Result<float> value = _definitions.value(line.label);
+        std::ostringstream shown;
+        if (value)
+            shown << *value;
+        rows.push_back(hbox({
+            text(line.label + " = "),
+            value ? text(shown.str()) | bold : text(shortError(value.error().code)) | color(Color::Red),
+        }));
+    }
+    return vbox({
+        filler(),
+        hbox({
+            _input_definitions->Render() | size(WIDTH, GREATER_THAN, 30) | border,
+            vbox(rows) | size(WIDTH, GREATER_THAN, 20) | border,
+        }) | hcenter,
+        text("One definition per line, e.g. b = a^2 - 1") | dim | hcenter,
+        filler(),
+    });
+}
+
+ftxui::Element Interface::renderHistory() {
+    using namespace ftxui;
+    if (!_store)
+        return text("Nothing is kept without a store (see --store)") | dim | center;
+    refreshHistory();
+    if (_history.empty())
+        return text("Statements you evaluate are kept here, across sessions") | dim | center;
+    return vbox({
+        filler(),
+        _history_menu->Render() | vscroll_indicator | frame | size(HEIGHT, LESS_THAN, std::max(1, _rows() - 10)) |
+                border | hcenter,
+        text("Enter takes one back to the Statement Solver") | dim | hcenter,
+        filler(),
+    });
+}
+
+void writeEvent(std::ostream &out, const ftxui::Event &event) {
+    if (event.is_mouse() || event.input().empty())
+        return;
+    static constexpr char hex[] = "0123456789abcdef";
+    for (char c : event.input()) {
+        const auto byte = static_cast<unsigned char>(c);
+        if (byte >= 0x20 && byte < 0x7f && c != '\\') {
+            out << c;
+        } else {
+            out << "\\x" << hex[byte >> 4] << hex[byte & 0xf];
+        }
+    }
+    out << '\n';
+}
+
+std::vector<ftxui::Event> readSession(std::istream &in) {
+    std::vector<ftxui::Event> events;
+    std::string line;
+    std::string input;
+    while (std::getline(in, line)) {
+        input.clear();
+        for (std::size_t i = 0; i < line.size(); i++) {
+            unsigned byte = 0;
+            if (line[i] == '\\' && i + 3 < line.size() && line[i + 1] == 'x' &&
+                std::from_chars(&line[i + 2], &line[i + 4], byte, 16).ptr == &line[i + 4]) {
+                input += static_cast<char>(byte);
+                i += 3;
+            } else {
+                input += line[i];
+            }
+        }
+        if (input.empty())
+            continue;
+        // Typing is a character event (UTF-8 included); keys like arrows and
+        // Return are special events that compare equal to ftxui's own
+        const auto first = static_cast<unsigned char>(input[0]);
+        const bool character = (input.size() == 1 && first >= 0x20 && first < 0x7f) || first >= 0x80;
+        events.push_back(character ? ftxui::Event::Character(input) : ftxui::Event::Special(input));
+    }
+    return events;
+}
+
+} // namespace psv
@@ -5,93 +5,128 @@
 #ifndef MATH_MATTERS_PROCESSOR_CPP
 #define MATH_MATTERS_PROCESSOR_CPP
 #include "MathProcessor.h"
+#include "ParallelEvaluator.h"
 
 namespace psv
 {
-const std::regex paren_no_op(R"(\(-?\d+\))");
-const boost::regex unary_minus(R"(((?<=[*\/\+\-\^(])-(?=[\d\(])|^-))");
-const boost::regex unary_minus_exponent(R"((?<=\^)-)");
-
 // If I could do so simply, I would remove this right now
 using equation = std::string;
 
-static const std::array<char, 9> valid_ops = {'+', '-', '*', '/', '^', 'n', 'm'};
-static const std::array<char, 21> all_valid = {
-        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '.',
-        '+', '-', '*', '/', '^', '(', ')', ' ', 'n', 'm'
-};
-static const std::map<char, int> precedence = {
-        {'m', 6},
-        {'^', 5},
-        {'n', 4},
-        {'*', 3},
-        {'/', 3},
-        {'+', 2},
-        {'-', 2},
-        {'(', 1}
-};
-
-
-std::vector<const char*> invalid_characters;
-
 // Error Messages
-static const std::string invalid_characters_err = "Invalid Characters in Statement: Check your statement and ensure that"\
-                                                  "it only contains numbers, operators, and parentheses. Valid operators"\
-                                                  "include: +, -, *, /, ^";
-static const std::string parentheses_err = "Unbalanced Parentheses: Check your statement and ensure that every '(' has"\
-                                       "a corresponding ')' and vice versa.";
-static const std::string operator_err = "Invalid Operator Placement: Check your statement and ensure that operators are"\
-                                "not placed next to each other (exception for -), or next to a parenthesis.";
-static const std::string zero_division_err = "Zero Division Error: Check your statement and ensure that you are not"\
-                                             "dividing by zero.";
+static constexpr const char *invalid_characters_err = "Invalid Characters in Statement: Check your statement and ensure that "\
+                                                      "it only contains numbers, operators, and parentheses. Valid operators "\
+                                                      "include: +, -, *, /, ^";
+static constexpr const char *parentheses_err = "Unbalanced Parentheses: Check your statement and ensure that every '(' has "\
+                                           "a corresponding ')' and vice versa.";
+static constexpr const char *operator_err = "Invalid Operator Placement: Check your statement and ensure that operators are "\
+                                    "not placed next to each other (exception for -), or next to a parenthesis.";
+static constexpr const char *missing_operator_err = "Missing Operator: Check your statement and ensure that numbers and "\
+                                                    "parentheses are separated by an operator, e.g. 2*(3) rather than 2(3).";
+static constexpr const char *number_err = "Invalid Number: Check your statement and ensure that each number has at most "\
+                                          "one decimal point.";
+static constexpr const char *empty_err = "Empty Expression: Check your statement and ensure that it, and every pair of "\
+                                         "parentheses, contains something to evaluate.";
+static constexpr const char *too_long_err = "Statement Too Long: Check your statement and ensure that it fits within "\
+                                            "the evaluator's limits.";
+static constexpr const char *definition_err = "Invalid Definition: Check your definition and ensure that it has the form "\
+                                             "name = expression, where the name is letters, digits and _ and starts with a letter.";
+static constexpr const char *unknown_name_err = "Unknown Name: Check your statement and ensure that every name it uses is "\
+                                               "defined.";
+static constexpr const char *bad_reference_err = "Bad Reference: This statement uses a name whose own definition has an "\
+                                                "error; fix that one first.";
+static constexpr const char *cyclic_definition_err = "Cyclic Definition: Check your definitions and ensure that none of them "\
+                                                    "depends on itself, directly or through others.";
+static constexpr const char *budget_err = "Budget Exceeded: This statement needs more time, steps or room than this "\
+                                         "evaluation allows; simplify it or raise the limits.";
+static constexpr const char *call_err = "Invalid Function Call: Check your statement and ensure that every function "\
+                                       "is given as many arguments as it takes, separated by commas, e.g. max(1, 2).";
+static constexpr const char *zero_division_err = "Zero Division Error: Check your statement and ensure that you are not "\
+                                                 "dividing by zero.";
 
-void checkValidCharacters(const equation& eq) {
-    invalid_characters.clear();
-    for (auto const& character : eq) {
-        if (std::find(all_valid.begin(), all_valid.end(), character) == all_valid.end()) {
-            invalid_characters.push_back(&character);
-        }
-    }
-    if (!invalid_characters.empty()) {
-        throw std::invalid_argument("Invalid characters in equation");
+const char *errorMessage(ErrorCode code) {
+    switch (code) {
+        case ErrorCode::None:
+            return "";
+        case ErrorCode::InvalidCharacters:
+            return invalid_characters_err;
+        case ErrorCode::UnbalancedParentheses:
+            return parentheses_err;
+        case ErrorCode::InvalidOperator:
+            return operator_err;
+        case ErrorCode::MissingOperator:
+            return missing_operator_err;
+        case ErrorCode::InvalidNumber:
+            return number_err;
+        case ErrorCode::EmptyExpression:
+            return empty_err;
+        case ErrorCode::ZeroDivision:
+            return zero_division_err;
+        case ErrorCode::TooLong:
+            return too_long_err;
+        case ErrorCode::InvalidDefinition:
+            return definition_err;
+        case ErrorCode::UnknownName:
+            return unknown_name_err;
+        case ErrorCode::BadReference:
+            return bad_reference_err;
+        case ErrorCode::CyclicDefinition:
+            return cyclic_definition_err;
+        case ErrorCode::BudgetExceeded:
+            return budget_err;
+        case ErrorCode::InvalidCall:
+            return call_err;
     }
+    return "";
 }
 
-void validScoping(const equation & eq) {
-    psv::Stack<char> invalid_scope;
-    for (auto c : eq) {
-        if (c == '(') {
-            invalid_scope.place(c);
-        } else if (c == ')') {
-            if (invalid_scope.isEmpty()) {
-                throw std::invalid_argument(parentheses_err);
-            } else {
-                invalid_scope.pop();
-            }
+// Length of the function call name starting at i, counting the whitespace up to
+// its '(', or 0 when there isn't one
+static std::size_t functionName(const equation& eq, std::size_t i) {
+    std::size_t end = i;
+    while (end < eq.size() && isalpha(static_cast<unsigned char>(eq[end])))
+        end++;
+    if (end == i || findFunction(std::string_view(eq).substr(i, end - i)) == function_count)
+        return 0;
+    std::size_t paren = end;
+    while (paren < eq.size() && isspace(static_cast<unsigned char>(eq[paren])))
+        paren++;
+    return paren < eq.size() && eq[paren] == '(' ? paren - i : 0;
+}
+
+// Runs of consecutive invalid characters, so they can be highlighted together
+std::vector<Span> invalidCharacters(const equation& eq) {
+    std::vector<Span> spans;
+    for (std::size_t i = 0; i < eq.size(); i++) {
+        if (isValidCharacter(eq[i]) && !isFunction(eq[i]))
+            continue;
+        if (const std::size_t name = functionName(eq, i)) {
+            i += name - 1;
+            continue;
+        }
+        if (!spans.empty() && spans.back().offset + spans.back().length == i) {
+            spans.back().length++;
+        } else {
+            spans.push_back({i, 1});
         }
     }
-    if (!invalid_scope.isEmpty()) {
-        throw std::invalid_argument(parentheses_err);
-    }
+    return spans;
 }
 
 // In the case that the entire statement is wrapped in a pair of parentheses
 // (x) -> x
+// Only if they are actually a pair; (1)+(2) stays as is.
 void lonelyParentheses(equation & eq_copy){
-    if (eq_copy[0] == '(' && eq_copy[eq_copy.size() - 1] == ')') {
-        eq_copy = eq_copy.substr(1, eq_copy.size() - 2);
+    if (eq_copy.size() < 2 || eq_copy[0] != '(' || eq_copy[eq_copy.size() - 1] != ')')
+        return;
+    int depth = 0;
+    for (std::size_t i = 0; i < eq_copy.size() - 1; i++) {
+        if (eq_copy[i] == '(') depth++;
+        else if (eq_copy[i] == ')') depth--;
+        if (depth == 0)
+            return;
     }
-}
-
-// Only used for binary operators
-bool validOperator(const char preceding, const char succeeding) {
-    if(isOperator(preceding) || preceding == '(')
-        return false;
-    if(isOperator(succeeding) && (succeeding != 'n' && succeeding != 'm') || succeeding == ')')
-        return false;
-
-
-    return true;
+    eq_copy.erase(eq_copy.size() - 1);
+    eq_copy.erase(0, 1);
 }
 
 std::vector<const char*> operatorLocations(const equation & eq) {
@@ -100,7 +135,7 @@ std::vector<const char*> operatorLocations(const equation & eq) {
     // gather pointers to all operators
     const char* ptr = (&eq[0]);
     for(int i = 0; i < eq.size(); i++) {
-        if (std::find(valid_ops.begin(), valid_ops.end(), *ptr) != valid_ops.end()) {
+        if (isOperator(*ptr)) {
             operator_locations.push_back(ptr);
         }
         ptr++;
@@ -109,145 +144,222 @@ std::vector<const char*> operatorLocations(const equation & eq) {
     return operator_locations;
 }
 
-bool isOperator(const char& c) {
-    if (std::find(valid_ops.begin(), valid_ops.end(), c) != valid_ops.end())
-        return true;
-    else
-        return false;
-}
-
 void eliminateWhiteSpace(equation& eq) {
     eq.erase(remove_if(eq.begin(), eq.end(), isspace), eq.end());
 }
 
-void validOperators(const equation& eq) {
-    std::vector<const char*> operator_locations = operatorLocations(eq);
-    for (auto const& op : operator_locations) {
-        const char right = *(op + 1);
-        if(*op == 'n' || *op == 'm'){
-            if(!isdigit(right) && right != '(')
-                throw std::invalid_argument(operator_err);
-        } else {
-            const char left = *(op - 1);
-            if(!validOperator(left, right))
-                throw std::invalid_argument(operator_err);
-        }
+// Opcodes back to the names they came from, for the steps
+static void spellFunctions(std::string& step) {
+    for (std::size_t i = 0; i < step.size(); i++) {
+        if (!isFunction(step[i]))
+            continue;
+        const std::string_view name = functionInfo(step[i]).name;
+        step.replace(i, 1, name);
+        i += name.size() - 1;
     }
 }
 
 // Used to handle steps in the evaluation process
-static std::string last_step;
-std::vector<std::string> steps;
+static Error pushNumber(Stack<float>& output, const equation& eq, std::size_t offset, std::size_t length) {
+    const char *number = eq.c_str() + offset;
+    if (std::count(number, number + length, '.') > 1 || (length == 1 && *number == '.')) {
+        return {ErrorCode::InvalidNumber, offset, length};
+    }
+    output.place(std::strtof(number, nullptr));
+    return {};
+}
+
+// Shunting-yard over an already validated, normalized statement
+static Result<float> shuntingYard(const equation& eq, EvaluationContext& context) {
+    Stack<float>& output = context.output;
+    output.clear();
+    context.operators.clear();
+    const Error err = runShuntingYard(eq, context.operators,
+        [&](std::size_t offset, std::size_t length) { return pushNumber(output, eq, offset, length); },
+        [&] { return cycleStack(context); });
+    if (err)
+        return err;
+    if (output.size() != 1) {
+        return Error{ErrorCode::EmptyExpression, 0, eq.size()};
+    }
+    return output.pop();
+}
 
-float nonRpnEvaluate(const equation& eq) {
-    steps.clear();
-    equation eq_copy = eq;
+Error prepare(const equation& eq, equation& normalized, std::vector<std::size_t>& origin) {
+    normalized.resize(eq.size());
+    origin.resize(eq.size());
+    std::size_t length = stripWhiteSpace(eq, normalized.data(), origin.data());
+    if (length == 0) {
+        normalized.clear();
+        origin.clear();
+        return {ErrorCode::EmptyExpression, 0, eq.size()};
+    }
+    // Quick scan for most issues before trying to evaluate; the same one constEvaluate() runs
+    const Error err = validateNormalized(normalized.data(), origin.data(), length);
+    normalized.resize(length);
+    origin.resize(length);
+    if (err)
+        return locate(err, origin, origin.size(), eq.size());
+    return {};
+}
+
+// evaluate() from the point where the statement is prepared
+static Result<float> evaluateSteps(const equation& normalized, const std::vector<std::size_t>& origin,
+                                   std::size_t size, EvaluationContext& context) {
+    // Too many tokens or too deep is known before doing any of the work
+    if (Error err = context.meter.measure(normalized))
+        return locate(err, origin, origin.size(), size);
+
+    // Steps for a statement this long are quadratic and no use to anyone anyway
+    if (normalized.size() >= parallel_threshold) {
+        Result<float> result = evaluatePrepared(normalized, 0, parallel_threshold, &context.meter);
+        if (!result)
+            return locate(result.error(), origin, origin.size(), size);
+        return result;
+    }
 
-    eliminateWhiteSpace(eq_copy);
-    // Use 'n' to represent unary minus
-    // -3+ 4 * 2 / ( 1 - -5 ) ^ 2 ^ 3
-    eq_copy = boost::regex_replace(eq_copy, unary_minus_exponent, "m");
-    eq_copy = boost::regex_replace(eq_copy, unary_minus, "n");
+    context.last_step = normalized;
+    lonelyParentheses(context.last_step);
+    spellFunctions(context.last_step);
 
-    // Quick scan for most issues before trying to evaluate
-    checkValidCharacters(eq_copy);
-    validScoping(eq_copy);
-    validOperators(eq_copy);
-    lonelyParentheses(eq_copy);
-    last_step = eq_copy;
+    Result<float> result = shuntingYard(normalized, context);
+    if (!result)
+        return locate(result.error(), origin, origin.size(), size);
+    return result;
+}
+
+Result<float> evaluate(const equation& eq, EvaluationContext& context) {
+    // Everything from the previous evaluation goes at once
+    context.steps.clear();
+    context.arena.reset();
+    context.meter.start(context.budget);
+
+    if (Error err = prepare(eq, context.normalized, context.origin))
+        return err;
+    return evaluateSteps(context.normalized, context.origin, eq.size(), context);
+}
+
+Result<float> evaluateNormalized(const equation& normalized, const std::vector<std::size_t>& origin,
+                                 std::size_t size, EvaluationContext& context) {
+    context.steps.clear();
+    context.arena.reset();
+    context.meter.start(context.budget);
+    return evaluateSteps(normalized, origin, size, context);
+}
 
-    psv::Stack<float> output;
-    psv::Stack<char> operators;
-    std::string number_buffer;
-    for(auto& symbol : eq_copy) {
-        if(isdigit(symbol)){
-            number_buffer += symbol;
+// Remove parentheses that do not contain operators: (12) -> 12, (-3) -> -3,
+// but not a function's: sqrt(9) stays
+static void unwrapNumbers(std::string& step) {
+    std::size_t open = step.find('(');
+    while (open != std::string::npos) {
+        if (open > 0 && isalpha(static_cast<unsigned char>(step[open - 1]))) {
+            open = step.find('(', open + 1);
             continue;
-        } else {
-            if(!number_buffer.empty()){
-                output.place(std::stof(number_buffer));
-                number_buffer.clear();
-            }
         }
-        // => symbol is operator or parenthesis
-        if(operators.isEmpty() || symbol == '('){
-            operators.place(symbol);
-        } else if (symbol == ')') {
-            while (operators.top() != '(') {
-                cycleStack(output, operators);
-            }
-            operators.pop();
-        } else { // is a binary operator
-            while (!operators.isEmpty() && precedence.at(operators.top()) >= precedence.at(symbol)) {
-                cycleStack(output, operators);
-            }
-            operators.place(symbol);
+        std::size_t i = open + 1;
+        if (i < step.size() && step[i] == '-')
+            i++;
+        const std::size_t digits = i;
+        while (i < step.size() && isdigit(step[i]))
+            i++;
+        if (i > digits && i < step.size() && step[i] == ')') {
+            step.erase(i, 1);
+            step.erase(open, 1);
+            // ((3)) -> (3) may have just made another match one character back
+            open = step.find('(', open > 0 ? open - 1 : 0);
+        } else {
+            open = step.find('(', open + 1);
         }
     }
-    if(!number_buffer.empty())
-        output.place(std::stof(number_buffer));
-    number_buffer.clear();
-    // Utilize any remaining operators
-    for (int i = 0; i < operators.size()+1; ++i) {
-        cycleStack(output, operators);
-    }
-    return output.pop();
 }
 
 // Gather and parse the last step (for each step) in the evaluation process
-void parseLastStep(const std::string& target_exp, const std::string& target_reduced) {
-    // Remove parentheses that do not contain operators
-    std::smatch match;
-    while (std::regex_search(last_step, match, paren_no_op)) {
-        last_step.replace(last_step.find(match.str()), match.str().length(), match.str().substr(1, match.str().length() - 2));
-    }
+Limit parseLastStep(EvaluationContext& context, std::string_view target_exp, std::string_view target_reduced) {
+    std::string& last_step = context.last_step;
+    unwrapNumbers(last_step);
     // Replace target expression with target reduced
-    last_step.replace(last_step.find(target_exp), target_exp.length(), target_reduced);
+    // (the int-cast targets don't always survive e.g. fractional intermediates)
+    std::size_t target = last_step.find(target_exp);
+    if (target != std::string::npos)
+        last_step.replace(target, target_exp.length(), target_reduced);
+
+    if (Limit limit = context.meter.chargeStep(last_step.size()); limit != Limit::None)
+        return limit;
+    context.steps.push_back(context.arena.copy(last_step));
+    return Limit::None;
+}
 
-    last_step = last_step;
-    // Replace special unary minus character ('n') with regular minus ('-')
-    steps.push_back(last_step);
+// Same digits std::to_string(static_cast<int>(value)) would give, written in place
+static char *writeInt(char *out, float value) {
+    int truncated = 0;
+    if (value >= static_cast<float>(std::numeric_limits<int>::max()))
+        truncated = std::numeric_limits<int>::max();
+    else if (value <= static_cast<float>(std::numeric_limits<int>::min()))
+        truncated = std::numeric_limits<int>::min();
+    else if (value == value)
+        truncated = static_cast<int>(value);
+    return std::to_chars(out, out + 12, truncated).ptr;
 }
 
-void cycleStack(Stack<float> &output, Stack<char> &operators) {
+Error cycleStack(EvaluationContext& context) {
     // Every time we cycle the stack, we update the list of steps
     // Values are cast to int to avoid trailing zeros messing up find/replace
-    std::string target;
-    char op = operators.pop();
-    float b = output.pop();
-    if(isUnary(op)){
-        output.place(operateUnary(b, op));
-        target = op + std::to_string(static_cast<int>(b));
-    }else{ // isBinary
+    Stack<float>& output = context.output;
+    Stack<Operator>& operators = context.operators;
+    char target[40];
+    char *target_end = target;
+    Operator op = operators.pop();
+    // Each reduction is a step; what the steps take up is charged as they're recorded
+    if (context.meter.charge() != Limit::None)
+        return {ErrorCode::BudgetExceeded, op.offset, 1};
+    if (output.isEmpty())
+        return {ErrorCode::InvalidOperator, op.offset, 1};
+    if (isFunction(op.symbol)) { // name(a,b) -> value
+        const FunctionInfo& function = functionInfo(op.symbol);
+        float args[max_arity];
+        for (unsigned arg = function.arity; arg-- > 0;) {
+            if (output.isEmpty())
+                return {ErrorCode::InvalidCall, op.offset, 1};
+            args[arg] = output.pop();
+        }
+        Result<float> value = applyFunction(op.symbol, args);
+        if (!value)
+            return {value.error().code, op.offset, 1};
+        output.place(*value);
+        target_end = std::copy(function.name.begin(), function.name.end(), target_end);
+        for (unsigned arg = 0; arg < function.arity; arg++) {
+            *target_end++ = arg == 0 ? '(' : ',';
+            target_end = writeInt(target_end, args[arg]);
+        }
+        *target_end++ = ')';
+    } else if (isUnary(op.symbol)) {
+        float b = output.pop();
+        output.place(operateUnary(b, op.symbol));
+        *target_end++ = op.symbol;
+        target_end = writeInt(target_end, b);
+    } else { // isBinary
+        float b = output.pop();
+        if (output.isEmpty())
+            return {ErrorCode::InvalidOperator, op.offset, 1};
         float a = output.pop();
-        output.place(operateBinary(a, b, op));
-        target = std::to_string(static_cast<int>(a)) + op + std::to_string(static_cast<int>(b));
+        Result<float> value = operateBinary(a, b, op.symbol);
+        if (!value)
+            return {value.error().code, op.offset, 1};
+        if (op.symbol == '^' && context.meter.checkMagnitude(*value) != Limit::None)
+            return {ErrorCode::BudgetExceeded, op.offset, 1};
+        output.place(*value);
+        target_end = writeInt(target_end, a);
+        *target_end++ = op.symbol;
+        target_end = writeInt(target_end, b);
     }
-    parseLastStep(target, std::to_string(static_cast<int>(output.top())));
-}
-
-bool isUnary(char op) {
-    return op == 'n' || op == 'm';
+    char reduced[16];
+    char *reduced_end = writeInt(reduced, output.top());
+    if (parseLastStep(context, {target, static_cast<std::size_t>(target_end - target)},
+                      {reduced, static_cast<std::size_t>(reduced_end - reduced)}) != Limit::None)
+        return {ErrorCode::BudgetExceeded, op.offset, 1};
+    return {};
 }
 
-float operateBinary(float a, float b, char op){
-    switch (op) {
-        case '+':
-            return a + b;
-        case '-':
-            return a - b;
-        case '*':
-            return a * b;
-        case '/':
-            if (b == 0)
-                throw std::invalid_argument(zero_division_err);
-            return a / b;
-        case '^':
-            return pow(a, b);
-        default:
-            throw std::invalid_argument(invalid_characters_err);
-    }
-}
 float operateUnary(float a, char op) {
     if(op != 'n' && op != 'm'){// if we reach this, god help us
         throw std::invalid_argument(invalid_characters_err);
@@ -0,0 +1,369 @@
+#include "ParallelEvaluator.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+namespace psv
+{
+
+namespace
+{
+    struct Range {
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    // Read-only state shared by every thread working on one statement
+    struct Statement {
+        const equation &eq;
+        // partner[i] is the index of the ')' closing the '(' at i
+        std::vector<std::uint32_t> partner;
+        std::size_t grain;
+    };
+
+    // Per-thread scratch
+    struct Stacks {
+        Stack<float> output;
+        Stack<Operator> operators;
+        // shared by every thread on the statement; reductions are charged to it in
+        // batches so the threads aren't all hammering one counter
+        Meter *meter = nullptr;
+        std::size_t uncharged = 0;
+    };
+
+    // The statement split up into a tree. A node is split at its top-level
+    // operators of the lowest precedence, or isn't split and has a single piece;
+    // pieces long enough to be worth splitting again are nodes themselves, the
+    // rest are leaves, which shuntingYard evaluates in one go.
+    struct Piece {
+        bool node;
+        // into the nodes or the leaves
+        std::size_t index;
+    };
+
+    struct Node {
+        // what's left once the leading signs and wrapping parentheses are off
+        Range range;
+        // those signs, outermost first
+        std::string signs;
+        std::vector<std::size_t> splits;
+        std::vector<Piece> pieces;
+    };
+
+    struct Leaf {
+        Range range;
+        Result<float> value;
+    };
+}
+
+// Reductions between checks of the budget
+static constexpr std::size_t meter_batch = 256;
+
+static Error charge(Stacks &stacks, std::size_t offset) {
+    if (stacks.meter != nullptr && stacks.meter->charge(stacks.uncharged) != Limit::None)
+        return {ErrorCode::BudgetExceeded, offset, 1};
+    stacks.uncharged = 0;
+    return {};
+}
+
+static Error reduce(Stacks &stacks) {
+    Operator op = stacks.operators.pop();
+    if (++stacks.uncharged == meter_batch) {
+        if (Error err = charge(stacks, op.offset))
+            return err;
+    }
+    if (stacks.output.isEmpty())
+        return {ErrorCode::InvalidOperator, op.offset, 1};
+    if (isFunction(op.symbol)) {
+        float args[max_arity];
+        for (unsigned arg = functionInfo(op.symbol).arity; arg-- > 0;) {
+            if (stacks.output.isEmpty())
+                return {ErrorCode::InvalidCall, op.offset, 1};
+            args[arg] = stacks.output.pop();
+        }
+        Result<float> value = applyFunction(op.symbol, args);
+        if (!value)
+            return {value.error().code, op.offset, 1};
+        stacks.output.place(*value);
+        return {};
+    }
+    float b = stacks.output.pop();
+    if (isUnary(op.symbol)) {
+        stacks.output.place(operateUnary(b, op.symbol));
+        return {};
+    }
+    if (stacks.output.isEmpty())
+        return {ErrorCode::InvalidOperator, op.offset, 1};
+    float a = stacks.output.pop();
+    Result<float> value = operateBinary(a, b, op.symbol);
+    if (!value)
+        return {value.error().code, op.offset, 1};
+    if (op.symbol == '^' && stacks.meter != nullptr && stacks.meter->checkMagnitude(*value) != Limit::None)
+        return {ErrorCode::BudgetExceeded, op.offset, 1};
+    stacks.output.place(*value);
+    return {};
+}
+
+static Error pushNumber(Stacks &stacks, const equation &eq, std::size_t offset, std::size_t length) {
+    const char *number = eq.c_str() + offset;
+    if (std::count(number, number + length, '.') > 1 || (length == 1 && *number == '.'))
+        return {ErrorCode::InvalidNumber, offset, length};
+    stacks.output.place(std::strtof(number, nullptr));
+    return {};
+}
+
+// shuntingYard from MathProcessor.cpp over part of the statement, without the steps
+static Result<float> shuntingYard(const equation &eq, Range range, Stacks &stacks) {
+    stacks.output.clear();
+    stacks.operators.clear();
+    std::size_t number_start = 0;
+    std::size_t number_length = 0;
+    for (std::size_t i = range.begin; i < range.end; i++) {
+        const char symbol = eq[i];
+        if (isdigit(symbol) || symbol == '.') {
+            if (number_length == 0)
+                number_start = i;
+            number_length++;
+            continue;
+        } else if (number_length != 0) {
+            if (Error err = pushNumber(stacks, eq, number_start, number_length))
+                return err;
+            number_length = 0;
+        }
+        if (stacks.operators.isEmpty() || symbol == '(') {
+            stacks.operators.place({symbol, i});
+        } else if (symbol == ')') {
+            while (stacks.operators.top().symbol != '(') {
+                if (Error err = reduce(stacks))
+                    return err;
+            }
+            stacks.operators.pop();
+        } else if (symbol == ',') {
+            while (stacks.operators.top().symbol != '(') {
+                if (Error err = reduce(stacks))
+                    return err;
+            }
+        } else {
+            while (!stacks.operators.isEmpty() && precedence(stacks.operators.top().symbol) >= precedence(symbol)) {
+                if (Error err = reduce(stacks))
+                    return err;
+            }
+            stacks.operators.place({symbol, i});
+        }
+    }
+    if (number_length != 0) {
+        if (Error err = pushNumber(stacks, eq, number_start, number_length))
+            return err;
+    }
+    while (!stacks.operators.isEmpty()) {
+        if (Error err = reduce(stacks))
+            return err;
+    }
+    if (Error err = charge(stacks, range.end - 1))
+        return err;
+    if (stacks.output.size() != 1)
+        return Error{ErrorCode::EmptyExpression, range.begin, range.end - range.begin};
+    return stacks.output.pop();
+}
+
+// Breadth first, with the tree itself as the work list rather than a call per
+// level, so how deep the statement nests only costs memory
+static void plan(const Statement &statement, std::vector<Node> &nodes, std::vector<Leaf> &leaves) {
+    const equation &eq = statement.eq;
+    nodes.assign(1, Node{{0, eq.size()}, {}, {}, {}});
+    for (std::size_t n = 0; n < nodes.size(); n++) {
+        Range range = nodes[n].range;
+        std::string signs;
+        std::vector<std::size_t> splits;
+        while (range.end - range.begin >= statement.grain) {
+            // (x) -> x
+            while (eq[range.begin] == '(' && statement.partner[range.begin] == range.end - 1) {
+                range.begin++;
+                range.end--;
+            }
+
+            // The binary operators of the lowest precedence outside any parentheses
+            int lowest = 0;
+            for (std::size_t i = range.begin; i < range.end; i++) {
+                const char symbol = eq[i];
+                if (symbol == '(') {
+                    i = statement.partner[i];
+                    continue;
+                }
+                const int level = precedence(symbol);
+                if (level < 2 || isUnary(symbol) || isFunction(symbol))
+                    continue;
+                if (lowest == 0 || level < lowest) {
+                    lowest = level;
+                    splits.clear();
+                }
+                if (level == lowest)
+                    splits.push_back(i);
+            }
+
+            // A leading minus binds looser than '^' (-2^2 is -(2^2)) but tighter than the rest.
+            // Anywhere else a unary minus ends up inside one of the pieces.
+            if (!isUnary(eq[range.begin]) || (!splits.empty() && lowest <= precedence('n')))
+                break;
+            // signs aren't split at, so a run of them comes off at once
+            while (isUnary(eq[range.begin]))
+                signs.push_back(eq[range.begin++]);
+            splits.clear();
+        }
+
+        // One piece holding nearly the whole range leaves nothing worth sharing out,
+        // and following it down is how 1+2*(1+2*(...)) would turn into a node per level
+        if (!splits.empty()) {
+            std::size_t largest = std::max(splits.front() - range.begin, range.end - splits.back() - 1);
+            for (std::size_t p = 1; p < splits.size(); p++)
+                largest = std::max(largest, splits[p] - splits[p - 1] - 1);
+            if (range.end - range.begin - largest < statement.grain)
+                splits.clear();
+        }
+
+        std::vector<Piece> pieces;
+        pieces.reserve(splits.size() + 1);
+        for (std::size_t p = 0; p <= splits.size(); p++) {
+            const Range piece{p == 0 ? range.begin : splits[p - 1] + 1, p == splits.size() ? range.end : splits[p]};
+            if (!splits.empty() && piece.end - piece.begin >= statement.grain) {
+                pieces.push_back({true, nodes.size()});
+                nodes.push_back(Node{piece, {}, {}, {}});
+            } else {
+                pieces.push_back({false, leaves.size()});
+                leaves.push_back({piece, Result<float>(0.0f)});
+            }
+        }
+        Node &node = nodes[n];
+        node.range = range;
+        node.signs = std::move(signs);
+        node.splits = std::move(splits);
+        node.pieces = std::move(pieces);
+    }
+}
+
+// Every leaf is evaluated first, the threads each taking a run of them with about
+// the same number of characters; then the pieces are folded back together here
+static Result<float> evaluateTree(const Statement &statement, unsigned threads, Stacks &stacks) {
+    const equation &eq = statement.eq;
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    plan(statement, nodes, leaves);
+
+    std::size_t total = 0;
+    for (auto const &leaf : leaves)
+        total += leaf.range.end - leaf.range.begin;
+    const unsigned groups = static_cast<unsigned>(std::min<std::size_t>(threads, leaves.size()));
+    std::vector<std::size_t> first(groups + 1, leaves.size());
+    first[0] = 0;
+    std::size_t done = 0;
+    unsigned next = 1;
+    for (std::size_t l = 0; l < leaves.size() && next < groups; l++) {
+        while (next < groups && done >= total * next / groups)
+            first[next++] = l;
+        done += leaves[l].range.end - leaves[l].range.begin;
+    }
+
+    auto run = [&](unsigned g, Stacks &local) {
+        for (std::size_t l = first[g]; l < first[g + 1]; l++)
+            leaves[l].value = shuntingYard(eq, leaves[l].range, local);
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(groups - 1);
+    for (unsigned g = 1; g < groups; g++) {
+        workers.emplace_back([&run, &stacks, g]() {
+            Stacks local;
+            local.meter = stacks.meter;
+            run(g, local);
+        });
+    }
+    run(0, stacks);
+    for (auto &worker : workers)
+        worker.join();
+
+    // Depth first from the root, each node's pieces left to right, checking each
+    // one before the operator that consumes it: the order shuntingYard reduces them
+    // in, so the same error wins, and it's returned as soon as it's reached.
+    struct Fold {
+        std::size_t node;
+        std::size_t piece;
+        float folded;
+    };
+    auto absorb = [&](Fold &fold, float value) -> Error {
+        if (fold.piece++ == 0) {
+            fold.folded = value;
+            return {};
+        }
+        const std::size_t split = nodes[fold.node].splits[fold.piece - 2];
+        Result<float> result = operateBinary(fold.folded, value, eq[split]);
+        if (!result)
+            return {result.error().code, split, 1};
+        if (eq[split] == '^' && stacks.meter != nullptr && stacks.meter->checkMagnitude(*result) != Limit::None)
+            return {ErrorCode::BudgetExceeded, split, 1};
+        fold.folded = *result;
+        return {};
+    };
+    std::vector<Fold> folds(1, Fold{0, 0, 0});
+    while (true) {
+        Fold &fold = folds.back();
+        const Node &node = nodes[fold.node];
+        if (fold.piece < node.pieces.size()) {
+            const Piece piece = node.pieces[fold.piece];
+            if (piece.node) {
+                folds.push_back({piece.index, 0, 0});
+                continue;
+            }
+            const Result<float> &value = leaves[piece.index].value;
+            if (!value)
+                return value;
+            if (Error err = absorb(fold, *value))
+                return err;
+            continue;
+        }
+
+        // A finished node is the next piece of the one below it on the stack
+        float value = fold.folded;
+        for (auto sign = node.signs.rbegin(); sign != node.signs.rend(); ++sign)
+            value = operateUnary(value, *sign);
+        folds.pop_back();
+        if (folds.empty())
+            return value;
+        if (Error err = absorb(folds.back(), value))
+            return err;
+    }
+}
+
+Result<float> evaluatePrepared(const equation &normalized, unsigned threads, std::size_t grain, Meter *meter) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    Stacks stacks;
+    stacks.meter = meter;
+    if (threads == 1 || normalized.size() < grain || normalized.size() > UINT32_MAX)
+        return shuntingYard(normalized, {0, normalized.size()}, stacks);
+
+    Statement statement{normalized, std::vector<std::uint32_t>(normalized.size()), grain};
+    std::vector<std::size_t> open;
+    for (std::size_t i = 0; i < normalized.size(); i++) {
+        if (normalized[i] == '(') {
+            open.push_back(i);
+        } else if (normalized[i] == ')') {
+            statement.partner[open.back()] = static_cast<std::uint32_t>(i);
+            open.pop_back();
+        }
+    }
+    return evaluateTree(statement, threads, stacks);
+}
+
+Result<float> evaluateParallel(const equation &eq, unsigned threads, std::size_t grain) {
+    equation normalized;
+    std::vector<std::size_t> origin;
+    if (Error err = prepare(eq, normalized, origin))
+        return err;
+    Result<float> result = evaluatePrepared(normalized, threads, grain);
+    if (!result)
+        return locate(result.error(), origin, origin.size(), eq.size());
+    return result;
+}
+
+} // namespace psv
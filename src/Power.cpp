@@ -0,0 +1,39 @@
+#include "Power.h"
+
+namespace psv
+{
+
+void powColumn(const float *base, const float *exponent, float *out, std::size_t count) {
+    // Everything is computed as if the exponent were a small integer, with no
+    // early exits, so the loop vectorizes; the few elements where that guess was
+    // wrong are redone by power() afterwards. Needs -fno-trapping-math (see
+    // CMakeLists.txt), otherwise GCC won't if-convert the selects.
+    std::size_t others = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        const float e = exponent[i];
+        const float magnitude = std::fabs(e);
+        // written so it becomes a plain min instruction; NaN lands on the limit
+        const float clamped = std::min(static_cast<float>(column_exponent_limit), magnitude);
+        const int n = static_cast<int>(clamped);
+        // smallPower(), but with a select GCC knows how to vectorize
+        double result = 1;
+        double square = base[i];
+        for (int bit = 0; bit < small_power_rounds; bit++) {
+            result *= ((n >> bit) & 1) ? square : 1.0;
+            square *= square;
+        }
+        const double inverse = 1 / result;
+        out[i] = static_cast<float>(e < 0 ? inverse : result);
+        others += static_cast<float>(n) != magnitude;
+    }
+    if (others == 0)
+        return;
+    for (std::size_t i = 0; i < count; i++) {
+        const float magnitude = std::fabs(exponent[i]);
+        if (!(magnitude <= static_cast<float>(column_exponent_limit)) ||
+            static_cast<float>(static_cast<int>(magnitude)) != magnitude)
+            out[i] = power(base[i], exponent[i]);
+    }
+}
+
+} // namespace psv
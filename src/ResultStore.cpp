@@ -0,0 +1,558 @@
+#include "ResultStore.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace psv
+{
+
+namespace
+{
+
+// The header's atomics are shared with other processes through the mapping
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+constexpr char store_magic[8] = {'m', 'm', 's', 't', 'o', 'r', 'e', '\0'};
+constexpr std::uint32_t store_version = 1;
+constexpr std::size_t page_size = 4096;
+constexpr std::size_t bucket_slots = 8;
+constexpr std::size_t slot_bytes = 16;
+constexpr std::size_t min_log_bytes = 16 * page_size;
+
+constexpr std::uint32_t padding_flag = 1;
+constexpr std::uint32_t traced_flag = 2;
+
+// FNV-1a, then mixed so the low bits (which pick the bucket) depend on all of it
+std::uint64_t hashOf(std::string_view text) {
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ull;
+    }
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void putVarint(std::string &out, std::size_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool getVarint(const char *&in, const char *end, std::size_t &value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        const auto byte = static_cast<unsigned char>(*in++);
+        value |= static_cast<std::size_t>(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+// The first step whole, then each one after it as what it keeps of the one
+// before (a prefix and a suffix) and what goes in between. A step rewrites one
+// operation, so most of it is the same as the last.
+void encodeSteps(const std::vector<std::string_view> &steps, std::string &out) {
+    out.clear();
+    if (steps.empty())
+        return;
+    putVarint(out, steps[0].size());
+    out += steps[0];
+    for (std::size_t i = 1; i < steps.size(); i++) {
+        const std::string_view before = steps[i - 1];
+        const std::string_view after = steps[i];
+        const std::size_t shorter = std::min(before.size(), after.size());
+        std::size_t prefix = 0;
+        while (prefix < shorter && before[prefix] == after[prefix])
+            prefix++;
+        std::size_t suffix = 0;
+        while (suffix < shorter - prefix && before[before.size() - 1 - suffix] == after[after.size() - 1 - suffix])
+            suffix++;
+        putVarint(out, prefix);
+        putVarint(out, suffix);
+        putVarint(out, after.size() - prefix - suffix);
+        out += after.substr(prefix, after.size() - prefix - suffix);
+    }
+}
+
+// Two passes: the lengths first, so storage never moves under the views
+bool decodeSteps(std::string_view trace, std::size_t count, std::string &storage,
+                 std::vector<std::string_view> &steps) {
+    storage.clear();
+    steps.clear();
+    if (count == 0)
+        return true;
+    std::size_t total = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const char *in = trace.data();
+        const char *end = in + trace.size();
+        std::size_t last_start = 0;
+        std::size_t last_length = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t prefix = 0;
+            std::size_t suffix = 0;
+            std::size_t middle = 0;
+            if (i > 0 && (!getVarint(in, end, prefix) || !getVarint(in, end, suffix)))
+                return false;
+            if (!getVarint(in, end, middle) || middle > static_cast<std::size_t>(end - in) ||
+                prefix + suffix > last_length)
+                return false;
+            const std::size_t length = prefix + middle + suffix;
+            if (pass == 0) {
+                total += length;
+            } else {
+                const std::size_t start = storage.size();
+                storage.append(storage, last_start, prefix);
+                storage.append(in, middle);
+                storage.append(storage, last_start + last_length - suffix, suffix);
+                steps.emplace_back(storage.data() + start, length);
+                last_start = start;
+            }
+            in += middle;
+            last_length = length;
+        }
+        if (pass == 0)
+            storage.reserve(total);
+    }
+    return true;
+}
+
+std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::size_t align16(std::size_t size) {
+    return (size + 15) & ~std::size_t(15);
+}
+
+} // namespace
+
+struct ResultStore::Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t slot_count;
+    std::uint64_t log_bytes;
+    // Positions in the log only grow; position p is byte p % log_bytes of it.
+    // Records in [tail, head) are whole. Only moved under the exclusive lock.
+    alignas(64) std::atomic<std::uint64_t> head;
+    std::atomic<std::uint64_t> tail;
+    alignas(64) std::atomic<std::uint64_t> lookups;
+    std::atomic<std::uint64_t> hits;
+    std::atomic<std::uint64_t> stores;
+};
+
+// position is the record's plus one, so zero is an empty slot
+struct ResultStore::Slot {
+    std::uint64_t hash;
+    std::uint64_t position;
+};
+
+// Followed by the normalized statement, the statement as typed and the steps,
+// then padding up to a multiple of 16, the last 4 bytes of which are size again
+// (so the log can be read backwards). Padding records fill the end of the log
+// when the next record doesn't fit there, so no record wraps around.
+struct ResultStore::Record {
+    std::uint32_t size;
+    std::uint32_t flags;
+    std::uint64_t hash;
+    std::int64_t time;
+    float value;
+    std::uint32_t normalized_length;
+    std::uint32_t statement_length;
+    std::uint32_t trace_length;
+    std::uint32_t step_count;
+    std::uint32_t reserved;
+
+    const char *normalized() const { return reinterpret_cast<const char *>(this + 1); }
+    const char *statement() const { return normalized() + normalized_length; }
+    const char *trace() const { return statement() + statement_length; }
+};
+
+class ResultStore::Lock {
+public:
+    Lock(ResultStore &store, bool exclusive) : _guard(store._mutex), _fd(store._fd) {
+        while (::flock(_fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+            if (errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "Could not lock the result store");
+        }
+    }
+    ~Lock() { ::flock(_fd, LOCK_UN); }
+
+    Lock(const Lock &) = delete;
+    Lock &operator=(const Lock &) = delete;
+
+private:
+    std::lock_guard<std::mutex> _guard;
+    int _fd;
+};
+
+static std::size_t logOffset(std::uint64_t slot_count) {
+    return page_size + (slot_count * slot_bytes + page_size - 1) / page_size * page_size;
+}
+
+ResultStore::ResultStore(const std::string &path, const StoreOptions &options) {
+    static_assert(sizeof(Header) <= page_size && sizeof(Slot) == slot_bytes && sizeof(Record) == 48);
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+    auto map = [&]() {
+        void *memory = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (memory == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "Could not map " + path);
+        _memory = static_cast<char *>(memory);
+    };
+    try {
+        // Whoever gets here first with an empty file lays it out
+        Lock lock(*this, true);
+        struct stat info{};
+        if (::fstat(_fd, &info) != 0)
+            throw std::system_error(errno, std::generic_category(), "Could not read " + path);
+        if (info.st_size == 0) {
+            const std::uint64_t slot_count = std::bit_ceil(std::max(options.slots, bucket_slots));
+            const std::uint64_t log_bytes =
+                    (std::max(options.log_bytes, min_log_bytes) + page_size - 1) / page_size * page_size;
+            _size = logOffset(slot_count) + log_bytes;
+            if (::ftruncate(_fd, static_cast<off_t>(_size)) != 0)
+                throw std::system_error(errno, std::generic_category(), "Could not size " + path);
+            map();
+            // The file reads as zeros, which is empty slots and counters already
+            Header &fresh = header();
+            fresh.version = store_version;
+            fresh.slot_count = slot_count;
+            fresh.log_bytes = log_bytes;
+            std::memcpy(fresh.magic, store_magic, sizeof(store_magic));
+        } else {
+            _size = static_cast<std::size_t>(info.st_size);
+            if (_size < page_size)
+                throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                        path + " is not a result store");
+            map();
+            const Header &existing = header();
+            if (std::memcmp(existing.magic, store_magic, sizeof(store_magic)) != 0 ||
+                existing.version != store_version || existing.slot_count < bucket_slots ||
+                !std::has_single_bit(existing.slot_count) || existing.log_bytes % page_size != 0 ||
+                logOffset(existing.slot_count) + existing.log_bytes != _size)
+                throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                        path + " is not a result store");
+        }
+    } catch (...) {
+        if (_memory)
+            ::munmap(_memory, _size);
+        ::close(_fd);
+        throw;
+    }
+}
+
+ResultStore::~ResultStore() {
+    ::munmap(_memory, _size);
+    ::close(_fd);
+}
+
+ResultStore::Header &ResultStore::header() const {
+    return *reinterpret_cast<Header *>(_memory);
+}
+
+ResultStore::Slot *ResultStore::bucket(std::uint64_t hash) const {
+    const std::uint64_t buckets = header().slot_count / bucket_slots;
+    return reinterpret_cast<Slot *>(_memory + page_size) + (hash & (buckets - 1)) * bucket_slots;
+}
+
+// The record at position if it's whole, still in the log and not padding. The
+// file is shared with other programs, so nothing in it is taken on trust.
+const ResultStore::Record *ResultStore::record(std::uint64_t position) const {
+    const Header &h = header();
+    const std::uint64_t head = h.head.load(std::memory_order_acquire);
+    const std::uint64_t tail = h.tail.load(std::memory_order_relaxed);
+    if (position < tail || position >= head || position % 16 != 0)
+        return nullptr;
+    const std::uint64_t offset = position % h.log_bytes;
+    const auto *found = reinterpret_cast<const Record *>(_memory + logOffset(h.slot_count) + offset);
+    if (found->size < sizeof(Record) || found->size % 16 != 0 || offset + found->size > h.log_bytes ||
+        position + found->size > head || (found->flags & padding_flag))
+        return nullptr;
+    const std::uint64_t contents = std::uint64_t(found->normalized_length) + found->statement_length +
+                                   found->trace_length;
+    if (sizeof(Record) + contents + sizeof(std::uint32_t) > found->size)
+        return nullptr;
+    return found;
+}
+
+const ResultStore::Record *ResultStore::lookup(std::uint64_t hash, std::string_view normalized, Slot **slot) const {
+    Slot *candidates = bucket(hash);
+    for (std::size_t i = 0; i < bucket_slots; i++) {
+        if (candidates[i].position == 0 || candidates[i].hash != hash)
+            continue;
+        const Record *found = record(candidates[i].position - 1);
+        if (found && found->hash == hash &&
+            std::string_view(found->normalized(), found->normalized_length) == normalized) {
+            if (slot)
+                *slot = &candidates[i];
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+// In the quarter of the log that the next stores will write over
+bool ResultStore::ageing(std::uint64_t position) const {
+    const Header &h = header();
+    return position - h.tail.load(std::memory_order_relaxed) < h.log_bytes / 4;
+}
+
+void ResultStore::append(std::uint64_t hash, std::string_view normalized, std::string_view statement, float value,
+                         std::int64_t time, const std::string *trace, std::uint32_t step_count) {
+    Header &h = header();
+    Slot *slot = nullptr;
+    const Record *existing = lookup(hash, normalized, &slot);
+    if (existing && !trace && (existing->flags & traced_flag))
+        return;
+
+    // A quarter of the log at most, so one record can't wipe out the rest
+    const std::uint64_t largest = h.log_bytes / 4;
+    auto sizeWith = [&](const std::string *with) {
+        return align16(sizeof(Record) + normalized.size() + statement.size() + (with ? with->size() : 0) +
+                       sizeof(std::uint32_t));
+    };
+    std::uint64_t size = sizeWith(trace);
+    if (size > largest && trace) {
+        trace = nullptr;
+        step_count = 0;
+        size = sizeWith(nullptr);
+        if (existing && (existing->flags & traced_flag))
+            return;
+    }
+    if (size > largest)
+        return;
+
+    char *log = _memory + logOffset(h.slot_count);
+    std::uint64_t head = h.head.load(std::memory_order_relaxed);
+    std::uint64_t tail = h.tail.load(std::memory_order_relaxed);
+    // Tail moves first: what's about to be written over is gone before it's touched
+    auto makeRoom = [&](std::uint64_t needed) {
+        while (head + needed - tail > h.log_bytes) {
+            std::uint32_t oldest = 0;
+            std::memcpy(&oldest, log + tail % h.log_bytes, sizeof(oldest));
+            if (oldest < 16 || oldest % 16 != 0 || oldest > head - tail) {
+                tail = head;
+                break;
+            }
+            tail += oldest;
+        }
+        h.tail.store(tail, std::memory_order_relaxed);
+    };
+    auto writeSize = [&](char *at, std::uint32_t record_size) {
+        std::memcpy(at, &record_size, sizeof(record_size));
+        std::memcpy(at + record_size - sizeof(record_size), &record_size, sizeof(record_size));
+    };
+
+    if (head % h.log_bytes + size > h.log_bytes) {
+        const auto padding = static_cast<std::uint32_t>(h.log_bytes - head % h.log_bytes);
+        makeRoom(padding);
+        char *at = log + head % h.log_bytes;
+        writeSize(at, padding);
+        std::memcpy(at + sizeof(std::uint32_t), &padding_flag, sizeof(padding_flag));
+        head += padding;
+        h.head.store(head, std::memory_order_release);
+    }
+    makeRoom(size);
+
+    char *at = log + head % h.log_bytes;
+    Record fresh{};
+    fresh.size = static_cast<std::uint32_t>(size);
+    fresh.flags = trace ? traced_flag : 0;
+    fresh.hash = hash;
+    fresh.time = time;
+    fresh.value = value;
+    fresh.normalized_length = static_cast<std::uint32_t>(normalized.size());
+    fresh.statement_length = static_cast<std::uint32_t>(statement.size());
+    fresh.trace_length = trace ? static_cast<std::uint32_t>(trace->size()) : 0;
+    fresh.step_count = step_count;
+    std::memcpy(at, &fresh, sizeof(fresh));
+    char *contents = at + sizeof(Record);
+    std::memcpy(contents, normalized.data(), normalized.size());
+    std::memcpy(contents + normalized.size(), statement.data(), statement.size());
+    if (trace)
+        std::memcpy(contents + normalized.size() + statement.size(), trace->data(), trace->size());
+    writeSize(at, fresh.size);
+
+    // The same statement's slot, else an empty one or one whose record is gone,
+    // else the oldest in the bucket
+    if (!slot) {
+        Slot *candidates = bucket(hash);
+        slot = &candidates[0];
+        for (std::size_t i = 0; i < bucket_slots; i++) {
+            if (candidates[i].position == 0 || !record(candidates[i].position - 1)) {
+                slot = &candidates[i];
+                break;
+            }
+            if (candidates[i].position < slot->position)
+                slot = &candidates[i];
+        }
+    }
+    slot->hash = hash;
+    slot->position = head + 1;
+    // Only now is the record there for anyone to find
+    h.head.store(head + size, std::memory_order_release);
+}
+
+void ResultStore::promote(std::uint64_t hash, const std::string &normalized) {
+    Lock lock(*this, true);
+    Slot *slot = nullptr;
+    const Record *found = lookup(hash, normalized, &slot);
+    if (!found || !ageing(slot->position - 1))
+        return;
+    // Copied out first, since making room may write over it
+    const std::string statement(found->statement(), found->statement_length);
+    const std::string trace(found->trace(), found->trace_length);
+    const bool traced = found->flags & traced_flag;
+    append(hash, normalized, statement, found->value, now(), traced ? &trace : nullptr, found->step_count);
+}
+
+std::optional<float> ResultStore::find(const std::string &normalized) {
+    const std::uint64_t hash = hashOf(normalized);
+    std::optional<float> value;
+    bool old = false;
+    {
+        Lock lock(*this, false);
+        header().lookups.fetch_add(1, std::memory_order_relaxed);
+        Slot *slot = nullptr;
+        if (const Record *found = lookup(hash, normalized, &slot)) {
+            header().hits.fetch_add(1, std::memory_order_relaxed);
+            value = found->value;
+            old = ageing(slot->position - 1);
+        }
+    }
+    if (old)
+        promote(hash, normalized);
+    return value;
+}
+
+bool ResultStore::find(const std::string &normalized, float &value, std::string &storage,
+                       std::vector<std::string_view> &steps) {
+    const std::uint64_t hash = hashOf(normalized);
+    bool old = false;
+    {
+        Lock lock(*this, false);
+        header().lookups.fetch_add(1, std::memory_order_relaxed);
+        Slot *slot = nullptr;
+        const Record *found = lookup(hash, normalized, &slot);
+        if (!found || !(found->flags & traced_flag) ||
+            !decodeSteps({found->trace(), found->trace_length}, found->step_count, storage, steps))
+            return false;
+        header().hits.fetch_add(1, std::memory_order_relaxed);
+        value = found->value;
+        old = ageing(slot->position - 1);
+    }
+    if (old)
+        promote(hash, normalized);
+    return true;
+}
+
+void ResultStore::store(const std::string &normalized, const std::string &statement, float value,
+                        const std::vector<std::string_view> *steps) {
+    if (!std::isfinite(value))
+        return;
+    const std::uint64_t hash = hashOf(normalized);
+    Lock lock(*this, true);
+    // Entered again: the steps are the same ones, and a recall already keeps it from ageing out
+    if (const Record *existing = lookup(hash, normalized);
+        existing && (existing->flags & traced_flag) && existing->value == value)
+        return;
+    if (steps)
+        encodeSteps(*steps, _trace);
+    append(hash, normalized, statement, value, now(), steps ? &_trace : nullptr,
+           steps ? static_cast<std::uint32_t>(steps->size()) : 0);
+    header().stores.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<std::optional<float>> ResultStore::findAll(const std::vector<std::string> &normalized) {
+    std::vector<std::optional<float>> values(normalized.size());
+    std::vector<std::size_t> old;
+    {
+        Lock lock(*this, false);
+        std::uint64_t hits = 0;
+        for (std::size_t i = 0; i < normalized.size(); i++) {
+            Slot *slot = nullptr;
+            if (const Record *found = lookup(hashOf(normalized[i]), normalized[i], &slot)) {
+                values[i] = found->value;
+                hits++;
+                if (ageing(slot->position - 1))
+                    old.push_back(i);
+            }
+        }
+        header().lookups.fetch_add(normalized.size(), std::memory_order_relaxed);
+        header().hits.fetch_add(hits, std::memory_order_relaxed);
+    }
+    for (std::size_t i : old)
+        promote(hashOf(normalized[i]), normalized[i]);
+    return values;
+}
+
+void ResultStore::storeAll(const std::vector<Entry> &entries) {
+    Lock lock(*this, true);
+    const std::int64_t time = now();
+    std::uint64_t stored = 0;
+    for (auto const &entry : entries) {
+        const std::uint64_t hash = hashOf(entry.normalized);
+        if (!std::isfinite(entry.value))
+            continue;
+        // A batch run again shouldn't fill the log with what's already in it
+        if (const Record *existing = lookup(hash, entry.normalized); existing && existing->value == entry.value)
+            continue;
+        append(hash, entry.normalized, entry.statement, entry.value, time, nullptr, 0);
+        stored++;
+    }
+    header().stores.fetch_add(stored, std::memory_order_relaxed);
+}
+
+std::vector<ResultStore::Entry> ResultStore::history(std::size_t count) {
+    std::vector<Entry> entries;
+    Lock lock(*this, false);
+    const Header &h = header();
+    const char *log = _memory + logOffset(h.slot_count);
+    const std::uint64_t tail = h.tail.load(std::memory_order_relaxed);
+    std::uint64_t position = h.head.load(std::memory_order_acquire);
+    while (position > tail && entries.size() < count) {
+        std::uint32_t size = 0;
+        std::memcpy(&size, log + (position - sizeof(size)) % h.log_bytes, sizeof(size));
+        if (size < 16 || size % 16 != 0 || size > position - tail)
+            break;
+        position -= size;
+        const Record *found = record(position);
+        // Older records of a statement stored again since are left out
+        if (!found || lookup(found->hash, {found->normalized(), found->normalized_length}) != found)
+            continue;
+        entries.push_back({std::string(found->normalized(), found->normalized_length),
+                           std::string(found->statement(), found->statement_length), found->value, found->time});
+    }
+    return entries;
+}
+
+std::uint64_t ResultStore::version() const {
+    return header().head.load(std::memory_order_acquire);
+}
+
+ResultStore::Stats ResultStore::stats() const {
+    const Header &h = header();
+    return {h.lookups.load(std::memory_order_relaxed), h.hits.load(std::memory_order_relaxed),
+            h.stores.load(std::memory_order_relaxed)};
+}
+
+} // namespace psv
@@ -0,0 +1,463 @@
+#include "ShardedEvaluator.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ParallelEvaluator.h"
+
+namespace psv
+{
+
+namespace
+{
+
+// Everything shared lives in one MAP_SHARED mapping made before forking, so the
+// atomics below are used across processes and have to be lock-free
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+static_assert(std::atomic<bool>::is_always_lock_free);
+
+constexpr std::uint64_t no_line = std::numeric_limits<std::uint64_t>::max();
+constexpr std::uint64_t ring_capacity = 256;
+
+// Lines [line, end_line), the first of them starting at offset
+struct Task {
+    std::uint64_t line;
+    std::uint64_t end_line;
+    std::uint64_t offset;
+};
+
+// One producer (the coordinator), any number of consumers. Positions only grow;
+// position p lives in slot p % ring_capacity. A consumer reads the task at tail
+// and then claims it by moving tail on, so a slot is free again as soon as tail
+// passes it and a consumer that dies can't leave one stuck. A consumer that lost
+// the race may have read a slot while it was being refilled; its claim fails and
+// it throws the copy away (hence the atomic fields).
+struct Ring {
+    struct Slot {
+        std::atomic<std::uint64_t> line;
+        std::atomic<std::uint64_t> end_line;
+        std::atomic<std::uint64_t> offset;
+    };
+
+    alignas(64) std::atomic<std::uint64_t> head{0};
+    alignas(64) std::atomic<std::uint64_t> tail{0};
+    alignas(64) std::atomic<bool> closed{false};
+    Slot slots[ring_capacity];
+
+    bool tryPush(const Task &task) {
+        const std::uint64_t position = head.load(std::memory_order_relaxed);
+        if (position - tail.load(std::memory_order_acquire) == ring_capacity)
+            return false;
+        Slot &slot = slots[position % ring_capacity];
+        slot.line.store(task.line, std::memory_order_relaxed);
+        slot.end_line.store(task.end_line, std::memory_order_relaxed);
+        slot.offset.store(task.offset, std::memory_order_relaxed);
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(Task &task) {
+        std::uint64_t position = tail.load(std::memory_order_acquire);
+        while (position != head.load(std::memory_order_acquire)) {
+            const Slot &slot = slots[position % ring_capacity];
+            task = {slot.line.load(std::memory_order_relaxed), slot.end_line.load(std::memory_order_relaxed),
+                    slot.offset.load(std::memory_order_relaxed)};
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_acq_rel))
+                return true;
+        }
+        return false;
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+};
+
+// What a worker is up to, for the coordinator to pick up after it if it dies
+struct WorkerStatus {
+    // From before it tries to claim a task until it's finished with it, so a
+    // worker that isn't busy can't be holding one
+    std::atomic<bool> busy{false};
+    // The line being evaluated (no_line between tasks), where it starts, and the
+    // end of the task it's part of
+    std::atomic<std::uint64_t> line{no_line};
+    std::atomic<std::uint64_t> offset{0};
+    std::atomic<std::uint64_t> end_line{0};
+};
+
+enum class State : std::uint8_t {
+    Pending,
+    Done,
+    Crashed,
+};
+
+// One line's result. Offsets within a line fit in 32 bits: prepare() would need
+// far more memory than that for a longer statement.
+struct Record {
+    float value;
+    std::uint32_t offset;
+    std::uint32_t length;
+    ErrorCode code;
+    std::atomic<State> state;
+};
+
+// The file, read-only
+class Input {
+public:
+    explicit Input(const std::string &path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+        struct stat info{};
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "Could not read " + path);
+        }
+        _size = static_cast<std::size_t>(info.st_size);
+        if (_size != 0) {
+            void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "Could not map " + path);
+            }
+            _data = static_cast<const char *>(data);
+#ifdef POSIX_MADV_SEQUENTIAL
+            ::posix_madvise(data, _size, POSIX_MADV_SEQUENTIAL);
+#endif
+        }
+        ::close(fd);
+    }
+
+    ~Input() {
+        if (_data != nullptr)
+            ::munmap(const_cast<char *>(_data), _size);
+    }
+
+    Input(const Input &) = delete;
+    Input &operator=(const Input &) = delete;
+
+    const char *data() const { return _data; }
+    std::size_t size() const { return _size; }
+
+    // Length of the line starting at offset, without its '\n'
+    std::size_t lineLength(std::uint64_t offset) const {
+        const void *newline = std::memchr(_data + offset, '\n', _size - offset);
+        return newline == nullptr ? _size - offset : static_cast<const char *>(newline) - (_data + offset);
+    }
+
+private:
+    const char *_data = nullptr;
+    std::size_t _size = 0;
+};
+
+// The ring, a status per worker and a record per line, all in one shared mapping
+class Shared {
+public:
+    Shared(std::size_t workers, std::size_t lines) {
+        _records_offset = (sizeof(Ring) + workers * sizeof(WorkerStatus) + alignof(Record) - 1) /
+                          alignof(Record) * alignof(Record);
+        _size = _records_offset + lines * sizeof(Record);
+        void *memory = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "Could not map shared memory");
+        _memory = static_cast<char *>(memory);
+        // Fresh anonymous pages are zero, which is already a Pending record
+        _ring = new(_memory) Ring;
+        for (std::size_t w = 0; w < workers; w++)
+            new(status(w)) WorkerStatus;
+    }
+
+    ~Shared() {
+        ::munmap(_memory, _size);
+    }
+
+    Shared(const Shared &) = delete;
+    Shared &operator=(const Shared &) = delete;
+
+    Ring &ring() { return *_ring; }
+
+    WorkerStatus *status(std::size_t worker) {
+        return reinterpret_cast<WorkerStatus *>(_memory + sizeof(Ring)) + worker;
+    }
+
+    Record &record(std::uint64_t line) {
+        return reinterpret_cast<Record *>(_memory + _records_offset)[line];
+    }
+
+private:
+    char *_memory = nullptr;
+    std::size_t _size = 0;
+    std::size_t _records_offset = 0;
+    Ring *_ring = nullptr;
+};
+
+[[noreturn]] void work(Shared &shared, WorkerStatus &self, const Input &input, const ShardOptions &options,
+                       pid_t coordinator) {
+    Ring &ring = shared.ring();
+    equation statement;
+    unsigned idle = 0;
+    while (true) {
+        self.busy.store(true);
+        Task task{};
+        if (!ring.tryPop(task)) {
+            self.busy.store(false);
+            if (ring.closed.load(std::memory_order_acquire) || ::getppid() != coordinator)
+                ::_exit(0);
+            if (++idle < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        idle = 0;
+        self.end_line.store(task.end_line, std::memory_order_relaxed);
+        std::uint64_t offset = task.offset;
+        for (std::uint64_t line = task.line; line < task.end_line; line++) {
+            const std::size_t length = input.lineLength(offset);
+            Record &record = shared.record(line);
+            // done already when this is a range handed out again
+            if (record.state.load(std::memory_order_acquire) == State::Pending) {
+                self.offset.store(offset, std::memory_order_relaxed);
+                self.line.store(line, std::memory_order_release);
+                if (options.before_line != nullptr)
+                    options.before_line(line);
+                statement.assign(input.data() + offset, length);
+                // The workers are the parallelism; each statement gets one thread
+                Result<float> result = evaluateParallel(statement, 1);
+                record.value = result ? *result : 0.0f;
+                record.code = result.error().code;
+                record.offset = static_cast<std::uint32_t>(result.error().offset);
+                record.length = static_cast<std::uint32_t>(result.error().length);
+                record.state.store(State::Done, std::memory_order_release);
+            }
+            offset += length + 1;
+        }
+        self.line.store(no_line, std::memory_order_release);
+        self.busy.store(false);
+    }
+}
+
+// Forks, runs the workers and cleans up after them
+class Coordinator {
+public:
+    Coordinator(Shared &shared, const Input &input, const ShardOptions &options, std::size_t workers)
+            : _shared(shared), _input(input), _options(options), _pids(workers, -1) {}
+
+    ~Coordinator() {
+        _shared.ring().closed.store(true, std::memory_order_release);
+        for (pid_t pid : _pids) {
+            if (pid <= 0)
+                continue;
+            // only still running here when unwinding from an exception
+            if (!_finished)
+                ::kill(pid, SIGKILL);
+            int status = 0;
+            while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        }
+    }
+
+    Coordinator(const Coordinator &) = delete;
+    Coordinator &operator=(const Coordinator &) = delete;
+
+    bool spawn(std::size_t worker) {
+        WorkerStatus &status = *_shared.status(worker);
+        status.line.store(no_line);
+        status.busy.store(false);
+        const pid_t coordinator = ::getpid();
+        const pid_t pid = ::fork();
+        if (pid < 0) {
+            _pids[worker] = -1;
+            return false;
+        }
+        if (pid == 0) {
+            try {
+                work(_shared, status, _input, _options, coordinator);
+            } catch (...) {
+                ::_exit(EXIT_FAILURE);
+            }
+        }
+        _pids[worker] = pid;
+        return true;
+    }
+
+    bool anyAlive() const {
+        return std::any_of(_pids.begin(), _pids.end(), [](pid_t pid) { return pid > 0; });
+    }
+
+    bool allIdle() {
+        for (std::size_t w = 0; w < _pids.size(); w++) {
+            if (_pids[w] > 0 && _shared.status(w)->busy.load())
+                return false;
+        }
+        return true;
+    }
+
+    // Collect workers that died, put what they had back and replace them.
+    // Returns whether any did.
+    bool reap(std::deque<Task> &pending, ShardStats &stats) {
+        bool reaped = false;
+        for (std::size_t w = 0; w < _pids.size(); w++) {
+            if (_pids[w] <= 0)
+                continue;
+            int wait_status = 0;
+            if (::waitpid(_pids[w], &wait_status, WNOHANG) != _pids[w])
+                continue;
+            reaped = true;
+            stats.crashes++;
+            _pids[w] = -1;
+            if (std::optional<Task> rest = recover(*_shared.status(w))) {
+                pending.push_front(*rest);
+                stats.reassigned++;
+            }
+            if (!spawn(w) && !anyAlive())
+                throw std::system_error(errno, std::generic_category(), "Could not start a worker");
+        }
+        return reaped;
+    }
+
+    void finish() {
+        _finished = true;
+    }
+
+private:
+    // The part of a dead worker's task it didn't get to. The line it died on is
+    // retried until it has taken down max_attempts workers, then marked crashed.
+    std::optional<Task> recover(WorkerStatus &status) {
+        const std::uint64_t line = status.line.load(std::memory_order_acquire);
+        if (line == no_line)
+            return std::nullopt;
+        Task rest{line, status.end_line.load(std::memory_order_relaxed), status.offset.load(std::memory_order_relaxed)};
+        Record &record = _shared.record(line);
+        bool skip = record.state.load(std::memory_order_acquire) != State::Pending;
+        if (!skip && ++_attempts[line] >= std::max(1u, _options.max_attempts)) {
+            record.state.store(State::Crashed, std::memory_order_release);
+            skip = true;
+        }
+        if (skip) {
+            rest.offset += _input.lineLength(rest.offset) + 1;
+            rest.line++;
+        }
+        if (rest.line >= rest.end_line)
+            return std::nullopt;
+        return rest;
+    }
+
+    Shared &_shared;
+    const Input &_input;
+    const ShardOptions &_options;
+    std::vector<pid_t> _pids;
+    std::unordered_map<std::uint64_t, unsigned> _attempts;
+    bool _finished = false;
+};
+
+} // namespace
+
+ShardStats evaluateSharded(const std::string &path, const ShardOptions &options, const ShardSink &sink) {
+    Input input(path);
+    const std::size_t lines_per_task = std::max<std::size_t>(1, options.lines_per_task);
+
+    // Where every lines_per_task-th line starts, counting lines like std::getline
+    std::vector<std::uint64_t> chunks;
+    ShardStats stats;
+    for (std::uint64_t offset = 0; offset < input.size(); offset += input.lineLength(offset) + 1) {
+        if (stats.lines % lines_per_task == 0)
+            chunks.push_back(offset);
+        stats.lines++;
+    }
+    stats.tasks = chunks.size();
+    if (stats.lines == 0)
+        return stats;
+    auto chunk = [&](std::size_t c) {
+        return Task{c * lines_per_task, std::min<std::uint64_t>((c + 1) * lines_per_task, stats.lines), chunks[c]};
+    };
+
+    unsigned workers = options.workers != 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    workers = static_cast<unsigned>(std::min<std::size_t>(workers, chunks.size()));
+    Shared shared(workers, stats.lines);
+    Ring &ring = shared.ring();
+    Coordinator coordinator(shared, input, options, workers);
+    for (std::size_t w = 0; w < workers; w++)
+        coordinator.spawn(w);
+    if (!coordinator.anyAlive())
+        throw std::system_error(errno, std::generic_category(), "Could not start a worker");
+
+    std::deque<Task> pending;
+    std::size_t next_chunk = 0;
+    std::uint64_t next_line = 0;
+    while (next_line < stats.lines) {
+        bool progress = false;
+        while (!pending.empty() || next_chunk < chunks.size()) {
+            const Task task = pending.empty() ? chunk(next_chunk) : pending.front();
+            if (!ring.tryPush(task))
+                break;
+            if (pending.empty())
+                next_chunk++;
+            else
+                pending.pop_front();
+            progress = true;
+        }
+
+        for (; next_line < stats.lines; next_line++) {
+            Record &record = shared.record(next_line);
+            const State state = record.state.load(std::memory_order_acquire);
+            if (state == State::Pending)
+                break;
+            if (state == State::Crashed)
+                sink(next_line, std::nullopt);
+            else if (record.code == ErrorCode::None)
+                sink(next_line, Result<float>(record.value));
+            else
+                sink(next_line, Result<float>(Error{record.code, record.offset, record.length}));
+            progress = true;
+        }
+
+        if (coordinator.reap(pending, stats))
+            progress = true;
+        if (progress)
+            continue;
+
+        // Nothing left to hand out and every worker idle, yet lines are missing:
+        // a worker died between claiming a task and starting on it. Hand out
+        // whatever is still pending again.
+        if (pending.empty() && next_chunk == chunks.size() && ring.empty() && coordinator.allIdle()) {
+            for (std::uint64_t line = next_line; line < stats.lines;) {
+                if (shared.record(line).state.load(std::memory_order_acquire) != State::Pending) {
+                    line++;
+                    continue;
+                }
+                const std::size_t c = line / lines_per_task;
+                std::uint64_t offset = chunks[c];
+                for (std::uint64_t skip = c * lines_per_task; skip < line; skip++)
+                    offset += input.lineLength(offset) + 1;
+                const std::uint64_t end_line = chunk(c).end_line;
+                pending.push_back({line, end_line, offset});
+                stats.reassigned++;
+                line = end_line;
+            }
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    coordinator.finish();
+    return stats;
+}
+
+} // namespace psv
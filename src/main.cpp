@@ -1,224 +1,173 @@
 #include <iostream>
-#include <iomanip>
+#include <fstream>
 #include <vector>
-#include <boost/regex.hpp>
-#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <boost/program_options.hpp>
 #include <spdlog/spdlog.h>
 #include "spdlog/sinks/basic_file_sink.h"
-#include "ftxui/dom/elements.hpp"
 #include "ftxui/component/component.hpp"
 #include "ftxui/component/screen_interactive.hpp"
+#include "ftxui/component/event.hpp"
+#include "ftxui/screen/terminal.hpp"
 #include "MathProcessor.h"
+#include "BatchCompiler.h"
+#include "ShardedEvaluator.h"
+#include "ResultStore.h"
+#include "Interface.h"
 
 auto static logger = spdlog::basic_logger_mt("basic_logger", "basic-log.txt");
 auto static step_logger = spdlog::basic_logger_mt("step_logger", "step-log.txt");
 
+static void printResult(const psv::Result<float>& result) {
+    if (result) {
+        std::cout << *result << '\n';
+    } else {
+        std::cout << "error at " << result.error().offset << ": " << psv::errorMessage(result.error().code) << '\n';
+    }
+}
 
-int main() {
-    using namespace ftxui;
-    auto screen = ScreenInteractive::Fullscreen();
-
-    std::string statement;
-    float result;
-    std::string result_string;
-    std::stringstream result_stream;
-    std::string warning_msg;
-
-    bool reveal_answer = false;
-    bool show_steps = true;
-    bool show_warnings = false;
-    bool valid_input = true;
-    bool anything_entered = false;
-
-    InputOption _input_statement;
-    _input_statement.on_change = [&]{
-        anything_entered = true;
-        if(statement.size() < 2)
-            return;
-        try {
-            result_stream.str(std::string());
-            result = psv::nonRpnEvaluate(statement);
-            result_stream << std::fixed << std::setprecision(1) << result;
-            result_string = result_stream.str();
-            valid_input = true;
-            warning_msg.clear();
-            spdlog::get("basic_logger")->info(result_string);
-        } catch (std::exception& e) {
-            valid_input = false;
-            reveal_answer = false;
-            warning_msg = e.what();
-            spdlog::get("basic_logger")->error(e.what());
-        }
-    };
-    _input_statement.on_enter = [&] {
-        reveal_answer = valid_input;
-    };
-
-Component input_statement = Input(&statement, "Enter a Statement", _input_statement);
+// The results store, or none when it can't be opened (which isn't worth stopping for)
+static std::unique_ptr<psv::ResultStore> openStore(const std::string& path) {
+    try {
+        return std::make_unique<psv::ResultStore>(path);
+    } catch (const std::system_error& e) {
+        std::cerr << e.what() << "; results won't be kept" << std::endl;
+        spdlog::get("basic_logger")->warn("No result store: {}", e.what());
+        return nullptr;
+    }
+}
 
-    auto button_evaluate = Button("Evaluate", [&] {
-        reveal_answer = valid_input;
-        spdlog::get("step_logger")->info("Statement: " + statement);
-        for(auto const& step : psv::steps) {
-            spdlog::get("step_logger")->info(step);
+// Evaluate one statement per line of path, printing results in the same order.
+// Statements already in the store aren't evaluated again; the rest are added to it.
+static int runBatch(const std::string& path, psv::ResultStore* store) {
+    std::ifstream input(path);
+    if (!input) {
+        std::cerr << "Could not open " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(input, line)) {
+        lines.push_back(std::move(line));
+    }
+    // Normalized for the store; left empty when prepare() fails, and the batch reports why
+    std::vector<std::string> normalized(lines.size());
+    std::vector<std::optional<float>> kept(lines.size());
+    if (store) {
+        std::vector<std::size_t> origin;
+        for (std::size_t i = 0; i < lines.size(); i++) {
+            if (psv::prepare(lines[i], normalized[i], origin))
+                normalized[i].clear();
         }
-        spdlog::get("step_logger")->info("\n");
-    }, ButtonOption::Ascii());
-
-    auto button_reset = Button("Reset", [&] {
-        statement = "";
-        result = 0;
-        result_string = "";
-        reveal_answer = false;
-        valid_input = true;
-        anything_entered = false;
-        psv::steps.clear();
-        warning_msg.clear();
-    }, ButtonOption::Ascii());
-
-    auto document_main = Container::Vertical({
-                                                input_statement,
-                                                button_evaluate | Maybe([&] { return !reveal_answer; }),
-                                                button_reset | Maybe(&reveal_answer),
-                                        });
-
-    auto Steps = Renderer([&] {
-        if(!show_steps || !reveal_answer) {
-            return vbox({});
+        kept = store->findAll(normalized);
+    }
+    psv::BatchCompiler batch;
+    for (std::size_t i = 0; i < lines.size(); i++) {
+        if (!kept[i])
+            batch.add(lines[i]);
+    }
+    const std::vector<psv::Result<float>> evaluated = batch.evaluate();
+    std::vector<psv::ResultStore::Entry> fresh;
+    std::size_t next = 0;
+    for (std::size_t i = 0; i < lines.size(); i++) {
+        if (kept[i]) {
+            printResult(*kept[i]);
+            continue;
         }
-        Elements step_children; // haha
-        // Get diffs between steps
-        for(int i = 0; i < psv::steps.size()-1; i++) {
-            std::string current_step = psv::steps[i];
-            std::string next_step = psv::steps[i + 1];
-            current_step = boost::regex_replace(current_step, boost::regex(R"([mn])"), "-");
-            next_step = boost::regex_replace(next_step, boost::regex(R"([mn])"), "-");
-
-            std::string before_diff;
-            std::string diff;
-            std::string after_diff;
-
-            int dif_start = 0;
-            int diff_end = 0;
-            for (int j = 0; j < next_step.size(); j++) {
-                if (current_step[j] != next_step[j]) {
-                    dif_start = j;
-                    break;
-                }
-            }
-            for (int j = 1; j < next_step.size(); j++) {
-                if (current_step[current_step.size() - j] != next_step[next_step.size() - j]) {
-                    diff_end = current_step.size() - j;
-                    break;
-                }
-            }
-            before_diff = current_step.substr(0, dif_start);
-            diff = current_step.substr(dif_start, diff_end - dif_start + 1);
-            after_diff = current_step.substr(diff_end + 1, current_step.size());
-
-            std::string next_before_diff = next_step.substr(0, dif_start);
-            std::string next_diff;
-            int z = 0;
-            while(!psv::isOperator(next_step[dif_start + z]) && (dif_start + z) < next_step.size() &&
-            next_step[dif_start + z] != ')'){
-                next_diff += next_step[z+dif_start];
-                z++;
-            }
-            std::string next_after_diff = next_step.substr(dif_start + z, next_step.size());
+        const psv::Result<float>& result = evaluated[next++];
+        printResult(result);
+        if (store && result && !normalized[i].empty())
+            fresh.push_back({normalized[i], lines[i], *result});
+    }
+    if (store)
+        store->storeAll(fresh);
+    const std::size_t recalled = lines.size() - batch.size();
+    std::cerr << lines.size() << " statements, " << recalled << " from the store, " << batch.nodeCount()
+              << " distinct nodes, " << batch.deduplicated() << " deduplicated" << std::endl;
+    spdlog::get("basic_logger")->info("Batch {}: {} statements, {} from the store, {} nodes, {} deduplicated",
+                                      path, lines.size(), recalled, batch.nodeCount(), batch.deduplicated());
+    return EXIT_SUCCESS;
+}
 
-        // Current step with diff to next in red
-        step_children.push_back(hbox({
-                text(before_diff),
-                text(diff) | strikethrough | color(Color::Red),
-                text(after_diff),
-            }) | hcenter);
-        if(i < psv::steps.size()-2){
-            // Next step with diff to previous in green
-            step_children.push_back(hbox({
-                     text(next_before_diff),
-                        text(next_diff) | color(Color::Green),
-                        text(next_after_diff),
-                 }) | dim | hcenter);
+// Same output as runBatch, from worker processes sharing the mapped file
+static int runShardedBatch(const std::string& path, unsigned workers) {
+    psv::ShardOptions options;
+    options.workers = workers;
+    psv::ShardStats stats;
+    try {
+        stats = psv::evaluateSharded(path, options, [](std::size_t, const std::optional<psv::Result<float>>& result) {
+            if (result) {
+                printResult(*result);
+            } else {
+                std::cout << "error: this statement crashed the evaluator\n";
             }
-            step_children.push_back(hbox({
-                text(" ")
-                }) | hcenter);
-        }
-        return vbox({
-            text("Steps:") | dim ,
-            vbox(step_children),
-        });
-    });
-
-    auto Math_Matters = Renderer(document_main, [&] {
-        auto result_conditional = reveal_answer ? hbox({
-            text("=") | bold,
-            text(result_string) | bold,
-        }) | vcenter : hbox({});
-
-        auto warnings = show_warnings ? hbox({
-            text(warning_msg) | color(Color::Red),
-        }) | center : hbox({});
-
-
-        return vbox({
-            filler(),
-            hbox({
-                input_statement->Render() | flex_shrink | border,
-            }) | vcenter | hcenter,
-            Steps->Render() | hcenter,
-            result_conditional | hcenter,
-            warnings,
-            hbox({
-                reveal_answer ? button_reset->Render()
-                : button_evaluate->Render() | (valid_input ? color(Color::Green) : color(Color::Red)),
-            }) | vcenter | hcenter ,
-            filler(),
-        });
-    });
-
-    auto toggle_steps = Checkbox("Show Steps?", &show_steps);
-    auto toggle_warnings = Checkbox("Show Warnings?", &show_warnings);
-
-    auto document_settings = Container::Vertical({
-        toggle_steps,
-        toggle_warnings,
-    });
-    auto Settings_Help = Renderer(document_settings, [&] {
-        return vbox({
-            filler(),
-            vbox({
-                 text("Settings") | bold | hcenter,
-                 toggle_steps->Render(),
-                 toggle_warnings->Render(),
-            }) | hcenter,
-            filler(),
         });
-    });
-
-    int tab_index = 0;
-    std::vector<std::string> tabs = {"Statement Solver", "Settings"};
-    auto tab_selection = Menu(&tabs, &tab_index, MenuOption::HorizontalAnimated());
-    auto tab_content = Container::Tab({
-        Math_Matters,
-        Settings_Help,
-    },
-    &tab_index);
+    } catch (const std::system_error& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cerr << stats.lines << " statements in " << stats.tasks << " tasks, " << stats.crashes
+              << " worker crashes, " << stats.reassigned << " tasks reassigned" << std::endl;
+    spdlog::get("basic_logger")->info("Sharded batch {}: {} statements, {} tasks, {} crashes, {} reassigned",
+                                      path, stats.lines, stats.tasks, stats.crashes, stats.reassigned);
+    return EXIT_SUCCESS;
+}
 
-    auto document = Container::Vertical({
-        tab_selection,
-        tab_content,
-    });
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Show this message")
+        ("batch,b", po::value<std::string>(), "Evaluate one statement per line of a file and exit")
+        ("workers,w", po::value<unsigned>(), "With --batch, evaluate on this many worker processes (0 for one per core)")
+        ("record,r", po::value<std::string>(), "Save the keystrokes of this session to a file, for bench/replay")
+        ("store,s", po::value<std::string>()->default_value("results.store"),
+         "Keep results in this file, across sessions (not used with --workers)")
+        ("no-store", "Don't look up or keep results");
+    po::variables_map args;
+    try {
+        po::store(po::parse_command_line(argc, argv, options), args);
+        po::notify(args);
+    } catch (po::error& e) {
+        std::cerr << e.what() << '\n' << options;
+        return EXIT_FAILURE;
+    }
+    if (args.count("help")) {
+        std::cout << options;
+        return EXIT_SUCCESS;
+    }
+    if (args.count("batch") && args.count("workers")) {
+        return runShardedBatch(args["batch"].as<std::string>(), args["workers"].as<unsigned>());
+    }
+    std::unique_ptr<psv::ResultStore> store;
+    if (!args.count("no-store")) {
+        store = openStore(args["store"].as<std::string>());
+    }
+    if (args.count("batch")) {
+        return runBatch(args["batch"].as<std::string>(), store.get());
+    }
 
-    auto main_renderer = Renderer(document, [&] {
-        return vbox({
-            text("Math-Matters") | bold,
-            tab_selection->Render(),
-            tab_content->Render() | flex,
-            text("by Peter V.")
+    using namespace ftxui;
+    auto screen = ScreenInteractive::Fullscreen();
+    psv::Interface interface([] { return Terminal::Size().dimy; }, store.get());
+    Component main_renderer = interface.component();
+
+    // Keep every keystroke for replaying later (see bench/replay.cpp)
+    std::ofstream session;
+    if (args.count("record")) {
+        session.open(args["record"].as<std::string>());
+        if (!session) {
+            std::cerr << "Could not open " << args["record"].as<std::string>() << std::endl;
+            return EXIT_FAILURE;
+        }
+        main_renderer |= CatchEvent([&](Event event) {
+            psv::writeEvent(session, event);
+            return false;
         });
-    });
-
+    }
 
     screen.Loop(main_renderer);
 
@@ -0,0 +1,256 @@
+#include "mathmatters.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <new>
+#include "BatchCompiler.h"
+#include "MathProcessor.h"
+#include "ParallelEvaluator.h"
+
+// The C API over the core; nothing may throw past it
+
+static_assert(static_cast<int>(psv::ErrorCode::InvalidCall) == MM_INVALID_CALL,
+              "mm_status has to follow psv::ErrorCode");
+static_assert(static_cast<int>(psv::Limit::StepBytes) == MM_LIMIT_STEP_BYTES, "mm_limit has to follow psv::Limit");
+
+struct mm_context {
+    psv::EvaluationContext evaluation;
+    psv::CancellationToken cancellation;
+    psv::BatchCompiler batch;
+    // the statement being evaluated, as prepare() wants it
+    psv::equation statement;
+    bool steps = false;
+};
+
+struct mm_program {
+    psv::equation normalized;
+    std::vector<std::size_t> origin;
+    std::size_t size;
+};
+
+namespace
+{
+
+int report(mm_error *error, psv::Error err, psv::Limit limit = psv::Limit::None) {
+    if (error != nullptr)
+        *error = {static_cast<int>(err.code), err.offset, err.length, static_cast<int>(limit)};
+    return static_cast<int>(err.code);
+}
+
+int report(mm_error *error, mm_status status) {
+    if (error != nullptr)
+        *error = {status, 0, 0, MM_LIMIT_NONE};
+    return status;
+}
+
+// evaluate() without the steps, for a statement that's already prepared
+psv::Result<float> evaluateNormalized(mm_context &context, const psv::equation &normalized,
+                                      const std::vector<std::size_t> &origin, std::size_t size) {
+    context.evaluation.meter.start(context.evaluation.budget);
+    if (psv::Error err = context.evaluation.meter.measure(normalized))
+        return psv::locate(err, origin, origin.size(), size);
+    const unsigned threads = normalized.size() < psv::parallel_threshold ? 1 : 0;
+    psv::Result<float> result = psv::evaluatePrepared(normalized, threads, psv::parallel_threshold,
+                                                      &context.evaluation.meter);
+    if (!result)
+        return psv::locate(result.error(), origin, origin.size(), size);
+    return result;
+}
+
+int finish(mm_context &context, const psv::Result<float> &result, float *value, mm_error *error) {
+    if (!result) {
+        const psv::Limit limit = result.error().code == psv::ErrorCode::BudgetExceeded
+                                 ? context.evaluation.meter.exceeded() : psv::Limit::None;
+        return report(error, result.error(), limit);
+    }
+    *value = *result;
+    return report(error, psv::Error{});
+}
+
+} // namespace
+
+extern "C" {
+
+int mm_api_version(void) {
+    return MM_API_VERSION;
+}
+
+const char *mm_error_message(int code) {
+    switch (code) {
+        case MM_OUT_OF_MEMORY:
+            return "Out of Memory: The evaluator couldn't allocate what this statement needs.";
+        case MM_INVALID_ARGUMENT:
+            return "Invalid Argument: A required pointer was NULL.";
+        case MM_INTERNAL:
+            return "Internal Error: The evaluator failed for a reason of its own, not the statement's.";
+        default:
+            if (code < MM_OK || code > MM_INVALID_CALL)
+                return "";
+            return psv::errorMessage(static_cast<psv::ErrorCode>(code));
+    }
+}
+
+mm_context *mm_context_create(void) {
+    try {
+        auto *context = new mm_context;
+        context->evaluation.budget.cancellation = &context->cancellation;
+        return context;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void mm_context_free(mm_context *context) {
+    delete context;
+}
+
+void mm_set_budget(mm_context *context, const mm_budget *budget) {
+    if (context == nullptr || budget == nullptr)
+        return;
+    psv::Budget &target = context->evaluation.budget;
+    target.max_tokens = budget->max_tokens;
+    target.max_depth = budget->max_depth;
+    target.max_reductions = budget->max_reductions;
+    target.timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::nanoseconds(budget->timeout_ns));
+    target.max_magnitude = budget->max_magnitude;
+    target.max_step_bytes = budget->max_step_bytes;
+}
+
+void mm_cancel(mm_context *context) {
+    if (context != nullptr)
+        context->cancellation.cancel();
+}
+
+void mm_clear_cancel(mm_context *context) {
+    if (context != nullptr)
+        context->cancellation.reset();
+}
+
+void mm_record_steps(mm_context *context, int enabled) {
+    if (context != nullptr)
+        context->steps = enabled != 0;
+}
+
+size_t mm_step_count(const mm_context *context) {
+    return context == nullptr ? 0 : context->evaluation.steps.size();
+}
+
+const char *mm_step(const mm_context *context, size_t index, size_t *length) {
+    if (context == nullptr || index >= context->evaluation.steps.size()) {
+        if (length != nullptr)
+            *length = 0;
+        return nullptr;
+    }
+    const std::string_view step = context->evaluation.steps[index];
+    if (length != nullptr)
+        *length = step.size();
+    return step.data();
+}
+
+int mm_evaluate(mm_context *context, const char *statement, size_t length, float *value, mm_error *error) {
+    if (context == nullptr || (statement == nullptr && length != 0) || value == nullptr)
+        return report(error, MM_INVALID_ARGUMENT);
+    try {
+        context->statement.assign(statement, length);
+        if (context->steps)
+            return finish(*context, psv::evaluate(context->statement, context->evaluation), value, error);
+        // the steps from any earlier evaluation go stale all the same
+        context->evaluation.steps.clear();
+        psv::EvaluationContext &evaluation = context->evaluation;
+        if (psv::Error err = psv::prepare(context->statement, evaluation.normalized, evaluation.origin))
+            return report(error, err);
+        return finish(*context, evaluateNormalized(*context, evaluation.normalized, evaluation.origin, length),
+                      value, error);
+    } catch (const std::bad_alloc &) {
+        return report(error, MM_OUT_OF_MEMORY);
+    } catch (...) {
+        return report(error, MM_INTERNAL);
+    }
+}
+
+mm_program *mm_compile(const char *statement, size_t length, mm_error *error) {
+    if (statement == nullptr && length != 0) {
+        report(error, MM_INVALID_ARGUMENT);
+        return nullptr;
+    }
+    try {
+        auto *program = new mm_program{{}, {}, length};
+        if (psv::Error err = psv::prepare(psv::equation(statement, length), program->normalized, program->origin)) {
+            delete program;
+            report(error, err);
+            return nullptr;
+        }
+        report(error, psv::Error{});
+        return program;
+    } catch (const std::bad_alloc &) {
+        report(error, MM_OUT_OF_MEMORY);
+        return nullptr;
+    } catch (...) {
+        report(error, MM_INTERNAL);
+        return nullptr;
+    }
+}
+
+int mm_run(mm_context *context, const mm_program *program, float *value, mm_error *error) {
+    if (context == nullptr || program == nullptr || value == nullptr)
+        return report(error, MM_INVALID_ARGUMENT);
+    try {
+        context->evaluation.steps.clear();
+        return finish(*context, evaluateNormalized(*context, program->normalized, program->origin, program->size),
+                      value, error);
+    } catch (const std::bad_alloc &) {
+        return report(error, MM_OUT_OF_MEMORY);
+    } catch (...) {
+        return report(error, MM_INTERNAL);
+    }
+}
+
+void mm_program_free(mm_program *program) {
+    delete program;
+}
+
+size_t mm_evaluate_batch(mm_context *context, const char *const *statements, const size_t *lengths,
+                         size_t count, float *values, mm_error *errors) {
+    auto fail = [&](mm_status status) {
+        for (size_t i = 0; i < count; i++) {
+            if (values != nullptr)
+                values[i] = std::numeric_limits<float>::quiet_NaN();
+            report(errors == nullptr ? nullptr : &errors[i], status);
+        }
+        return count;
+    };
+    if (context == nullptr || (statements == nullptr && count != 0) || (values == nullptr && count != 0))
+        return fail(MM_INVALID_ARGUMENT);
+    try {
+        context->batch.clear();
+        for (size_t i = 0; i < count; i++) {
+            const char *statement = statements[i] != nullptr ? statements[i] : "";
+            const size_t length = lengths != nullptr ? lengths[i] : std::strlen(statement);
+            context->statement.assign(statement, length);
+            context->batch.add(context->statement);
+        }
+        const std::vector<psv::Result<float>> results = context->batch.evaluate();
+        size_t failed = 0;
+        for (size_t i = 0; i < count; i++) {
+            mm_error *error = errors == nullptr ? nullptr : &errors[i];
+            if (results[i]) {
+                values[i] = *results[i];
+                report(error, psv::Error{});
+            } else {
+                values[i] = std::numeric_limits<float>::quiet_NaN();
+                report(error, results[i].error());
+                failed++;
+            }
+        }
+        return failed;
+    } catch (const std::bad_alloc &) {
+        context->batch.clear();
+        return fail(MM_OUT_OF_MEMORY);
+    } catch (...) {
+        context->batch.clear();
+        return fail(MM_INTERNAL);
+    }
+}
+
+} // extern "C"
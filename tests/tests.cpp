@@ -2,11 +2,33 @@
 // Created by Peter Vaiciulis on 3/2/23.
 //
 #include "catch2/catch_test_macros.hpp"
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <limits>
 #include <string>
+#include <thread>
 #include <boost/regex.hpp>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "MathProcessor.h"
+#include "ConstEval.h"
+#include "BatchCompiler.h"
+#include "ParallelEvaluator.h"
+#include "FastMath.h"
+#include "Definitions.h"
+#include "Budget.h"
+#include "Functions.h"
 #include "Stack.h"
+#include "ShardedEvaluator.h"
+#include "ResultStore.h"
+#include "mathmatters.h"
 
 TEST_CASE("Pre-Flight")
 {
@@ -25,21 +47,23 @@ TEST_CASE("Valid Characters", "[checkValidCharacters] [sanitization]")
     // valid equation
     const equation validEq = "1 + 1 - 3 * 4 / 5 ^ 6";
 
-//    REQUIRE_THROWS(checkValidCharacters(invalidChars));
-//    REQUIRE(invalid_characters.size() == 1);
-//    REQUIRE(*invalid_characters[0] == '@');
-//
-//    REQUIRE_THROWS(checkValidCharacters(invalidChars2));
-//    REQUIRE(invalid_characters.size() == 1);
-//    REQUIRE(*invalid_characters[0] == '#');
+    REQUIRE(checkValidCharacters(invalidChars).code == ErrorCode::InvalidCharacters);
+    REQUIRE(checkValidCharacters(invalidChars).offset == 22);
+
+    REQUIRE(checkValidCharacters(invalidChars2).offset == 22);
 
-    REQUIRE_THROWS(checkValidCharacters(invalidChars3));
-    REQUIRE(invalid_characters.size() == 2);
-    REQUIRE(*invalid_characters[0] == '%');
-    REQUIRE(*invalid_characters[1] == '$');
+    Error err = checkValidCharacters(invalidChars3);
+    REQUIRE(err.code == ErrorCode::InvalidCharacters);
+    REQUIRE(err.offset == 5);
+    REQUIRE(err.length == 1);
+    std::vector<Span> spans = invalidCharacters(invalidChars3);
+    REQUIRE(spans.size() == 2);
+    REQUIRE(invalidChars3[spans[0].offset] == '%');
+    REQUIRE(invalidChars3[spans[1].offset] == '$');
+    REQUIRE(invalidCharacters("1 + ab2").front().length == 2);
 
-    REQUIRE_NOTHROW(checkValidCharacters(validEq));
-    REQUIRE(invalid_characters.empty());
+    REQUIRE_FALSE(checkValidCharacters(validEq));
+    REQUIRE(invalidCharacters(validEq).empty());
 }
 
 TEST_CASE("Eliminate Whitespace", "[eliminateWhitespace] [sanitization]")
@@ -83,26 +107,36 @@ TEST_CASE("Scoping", "[scoping] [sanitization]")
 
 
     SECTION("Valid Scoping") {
-        REQUIRE_NOTHROW(validScoping(validEq));
-        REQUIRE_NOTHROW(validScoping(validEq2));
-        REQUIRE_NOTHROW(validScoping(validEq3));
-        REQUIRE_NOTHROW(validScoping(validEq4));
-        REQUIRE_NOTHROW(validScoping(validEq5));
-        REQUIRE_NOTHROW(validScoping(validEq6));
+        REQUIRE_FALSE(validScoping(validEq));
+        REQUIRE_FALSE(validScoping(validEq2));
+        REQUIRE_FALSE(validScoping(validEq3));
+        REQUIRE_FALSE(validScoping(validEq4));
+        REQUIRE_FALSE(validScoping(validEq5));
+        REQUIRE_FALSE(validScoping(validEq6));
     }
 
     SECTION("Invalid Scoping") {
-        REQUIRE_THROWS(validScoping(invalidEq), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq).code == ErrorCode::UnbalancedParentheses);
 
-        REQUIRE_THROWS(validScoping(invalidEq2), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq2).code == ErrorCode::UnbalancedParentheses);
 
-        REQUIRE_THROWS(validScoping(invalidEq3), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq3).code == ErrorCode::UnbalancedParentheses);
 
-        REQUIRE_THROWS(validScoping(invalidEq4), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq4).code == ErrorCode::UnbalancedParentheses);
 
-        REQUIRE_THROWS(validScoping(invalidEq5), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq5).code == ErrorCode::UnbalancedParentheses);
 
-        REQUIRE_THROWS(validScoping(invalidEq6), "Invalid Scoping");
+        REQUIRE(validScoping(invalidEq6).code == ErrorCode::UnbalancedParentheses);
+    }
+
+    SECTION("Error Location") {
+        REQUIRE(validScoping(invalidEq).offset == 21);
+        REQUIRE(validScoping(invalidEq2).offset == 0);
+        REQUIRE(validScoping(invalidEq6).offset == 0);
+        REQUIRE(validScoping("1 + ()").code == ErrorCode::EmptyExpression);
+        REQUIRE(validScoping("1 + ()").offset == 4);
+        REQUIRE(validScoping("(1) + (2").offset == 6);
+        REQUIRE(validScoping("((1) + (2").offset == 0);
     }
 }
 
@@ -323,6 +357,56 @@ TEST_CASE("Non-RPN Evaluate"){
     }
 }
 
+TEST_CASE("Evaluate", "[evaluate] [errors]"){
+    using namespace psv;
+    SECTION("Values"){
+        REQUIRE(evaluate("1 + 2").ok());
+        REQUIRE(*evaluate("1 + 2") == 3.0f);
+        REQUIRE(*evaluate("42") == 42.0f);
+        REQUIRE(*evaluate("(1) + (2)") == 3.0f);
+        REQUIRE(*evaluate("1.5 * 2") == 3.0f);
+        REQUIRE(*evaluate("1+2*3^2^2") == 163.0f);
+    }
+    SECTION("Errors point into the original statement"){
+        Result<float> result = evaluate("1 +  2 @# 3");
+        REQUIRE_FALSE(result.ok());
+        REQUIRE(result.error().code == ErrorCode::InvalidCharacters);
+        REQUIRE(result.error().offset == 7);
+        REQUIRE(result.error().length == 2);
+
+        result = evaluate("4 / (2 - 2)");
+        REQUIRE(result.error().code == ErrorCode::ZeroDivision);
+        REQUIRE(result.error().offset == 2);
+
+        result = evaluate("1 + 2 *");
+        REQUIRE(result.error().code == ErrorCode::InvalidOperator);
+        REQUIRE(result.error().offset == 6);
+
+        result = evaluate("(1 + 2");
+        REQUIRE(result.error().code == ErrorCode::UnbalancedParentheses);
+        REQUIRE(result.error().offset == 0);
+
+        REQUIRE(evaluate("2 (3)").error().code == ErrorCode::MissingOperator);
+        REQUIRE(evaluate("1.2.3").error().code == ErrorCode::InvalidNumber);
+        REQUIRE(evaluate("  ").error().code == ErrorCode::EmptyExpression);
+    }
+    SECTION("Already prepared"){
+        const equation statement = "2 * (3 + 4) / (1 - 1)";
+        equation normalized;
+        std::vector<std::size_t> origin;
+        REQUIRE_FALSE(prepare(statement, normalized, origin));
+        EvaluationContext context;
+        Result<float> result = evaluateNormalized(normalized, origin, statement.size(), context);
+        REQUIRE(result.error().code == ErrorCode::ZeroDivision);
+        REQUIRE(result.error().offset == 12);
+        REQUIRE(context.steps.size() == 3);
+
+        REQUIRE_FALSE(prepare("2 * (3 + 4)", normalized, origin));
+        REQUIRE(*evaluateNormalized(normalized, origin, 11, context) == 14.0f);
+        REQUIRE(context.steps.back() == "14");
+    }
+}
+
 TEST_CASE("Boost Regex"){
     using namespace boost;
     SECTION("Replace Unary Minus"){
@@ -347,3 +431,1051 @@ TEST_CASE("Boost Regex"){
     }
 
 }
+
+TEST_CASE("Compile-Time Evaluate", "[constEvaluate]"){
+    using namespace psv;
+    using namespace psv::literals;
+
+    static_assert(ct_eval("2^10-3*4") == 1012.0f);
+    static_assert(ct_eval("-(42*41) + 2 + 4 * 2/(1-5)+42^2") == 42.0f);
+    static_assert("2 ^ 3 ^ 2"_eval == 64.0f);
+    static_assert(constEvaluate<8>("1 / 0").error().code == ErrorCode::ZeroDivision);
+    static_assert(constEvaluate<8>("1 / 0").error().offset == 2);
+    static_assert(ct_eval("max(1,2)") == 2.0f);
+    static_assert(ct_eval("sqrt(16) + abs(-3) * mod(-7, 3)") == 1.0f);
+    static_assert("floor(-2.5) + min(4, -1)"_eval == -4.0f);
+    static_assert(constEvaluate<16>("mod(7, 0)").error().code == ErrorCode::ZeroDivision);
+    static_assert(constEvaluate<16>("max(1)").error().code == ErrorCode::InvalidCall);
+
+    // Anything the runtime evaluator says, the compile-time one should say too
+    const std::vector<std::string> statements = {
+            "1 + 2", "42", "(1) + (2)", "1.5 * 2", "2 ^ -1", "2^-2^2", "-2--4", "-(3+4)*2",
+            "((2 + 3) * 4 - 7) / (5 - 2) + 8 * (3 - 1)", "4 ^ 0.5", "0 ^ 0", "(-8) ^ 0.5",
+            "1 +  2 @# 3", "4 / (2 - 2)", "1 + 2 *", "(1 + 2", "2 (3)", "1.2.3", "  ", "--5", "1 + ()",
+            "max(1,2)", "min(3, -2) * 2", "sqrt(16) + abs(-3)", "-max(1, 2 ^ 3) ^ 2", "mod(-7.5, 2)",
+            "log(10) - exp(1)", "sin(1) + cos(2)", "floor(2.5)", "mod(7, 0)", "max(1)", "1, 2",
+            "max(1,)", "2 sqrt(4)", "foo(1)", "sqrt 4",
+    };
+    for (const auto &statement : statements) {
+        CAPTURE(statement);
+        Result<float> runtime = evaluate(statement);
+        Result<float> compile_time = constEvaluate<64>(statement);
+        REQUIRE(runtime.ok() == compile_time.ok());
+        if (runtime.ok()) {
+            if (std::isnan(*runtime)) {
+                REQUIRE(std::isnan(*compile_time));
+            } else {
+                REQUIRE(*runtime == Approx(*compile_time));
+            }
+        } else {
+            REQUIRE(runtime.error().code == compile_time.error().code);
+            REQUIRE(runtime.error().offset == compile_time.error().offset);
+            REQUIRE(runtime.error().length == compile_time.error().length);
+        }
+    }
+}
+
+TEST_CASE("Batch Compiler", "[batch]"){
+    using namespace psv;
+    const std::vector<std::string> statements = {
+            "(1 + 2) * 3", "4 - (1 + 2)", "(2 + 1) * 3", "-(1 + 2) ^ 2", "8 / (3 - 3)", "1 +",
+            "((2 + 3) * 4 - 7) / (5 - 2) + 8 * (3 - 1)", "2 ^ 3 ^ 2", "-2--4",
+            // whichever error comes first in reduction order
+            "1/0+1.2.3", "1.2.3+1/0", "4 - 2 / (1 - 1) * 3..4", "(1 + 2..3) / 0", "2 * (1 / 0) ^ 2 + 1..",
+    };
+    BatchCompiler batch;
+    for (const auto &statement : statements) {
+        batch.add(statement);
+    }
+    REQUIRE(batch.size() == statements.size());
+    REQUIRE(batch.deduplicated() > 0);
+    REQUIRE(batch.deduplicated() == batch.referenceCount() - batch.nodeCount());
+
+    std::vector<Result<float>> results = batch.evaluate();
+    for (std::size_t i = 0; i < statements.size(); i++) {
+        CAPTURE(statements[i]);
+        Result<float> expected = evaluate(statements[i]);
+        REQUIRE(results[i].ok() == expected.ok());
+        if (expected.ok()) {
+            REQUIRE(*results[i] == *expected);
+        } else {
+            REQUIRE(results[i].error().code == expected.error().code);
+            REQUIRE(results[i].error().offset == expected.error().offset);
+        }
+    }
+
+    SECTION("Sub-expressions are shared"){
+        BatchCompiler shared;
+        shared.add("(1+2)*3");
+        std::size_t nodes = shared.nodeCount();
+        shared.add("(2+1)*3");
+        REQUIRE(shared.nodeCount() == nodes);
+        shared.clear();
+        REQUIRE(shared.nodeCount() == 0);
+        REQUIRE(shared.size() == 0);
+    }
+}
+
+TEST_CASE("Arena", "[arena]"){
+    using namespace psv;
+    SECTION("Allocation"){
+        Arena arena(64);
+        auto *a = static_cast<double *>(arena.allocate(sizeof(double), alignof(double)));
+        REQUIRE(reinterpret_cast<std::uintptr_t>(a) % alignof(double) == 0);
+        std::string_view text = arena.copy("2*(5)");
+        REQUIRE(text == "2*(5)");
+        // spills into more blocks, then gets merged into one on reset
+        for (int i = 0; i < 10; i++)
+            arena.allocate(48, 1);
+        REQUIRE(arena.blocks() > 1);
+        std::size_t capacity = arena.capacity();
+        arena.reset();
+        REQUIRE(arena.blocks() == 1);
+        REQUIRE(arena.capacity() == capacity);
+        REQUIRE(arena.used() == 0);
+    }
+    SECTION("Evaluation context is reused"){
+        EvaluationContext context;
+        const equation statement = "2 * (1 + (3 - 2) * (2 + (5 - 3)))";
+        REQUIRE(*evaluate(statement, context) == 10.0f);
+        std::size_t capacity = context.arena.capacity();
+        REQUIRE(*evaluate(statement, context) == 10.0f);
+        REQUIRE(context.arena.capacity() == capacity);
+        REQUIRE(context.steps.size() == 6);
+        REQUIRE(context.steps[0] == "2*(1+(1)*(2+(5-3)))");
+        REQUIRE(context.steps[4] == "2*(5)");
+        REQUIRE(context.steps[5] == "10");
+        // the default context is separate
+        REQUIRE(*evaluate("1 + 2") == 3.0f);
+        REQUIRE(context.steps.size() == 6);
+        REQUIRE(steps.size() == 1);
+    }
+}
+
+TEST_CASE("Power", "[power]"){
+    using namespace psv;
+    SECTION("Integral exponents are exact while they fit"){
+        REQUIRE(power(2, 10) == 1024.0f);
+        REQUIRE(power(3, 15) == 14348907.0f);
+        REQUIRE(power(-3, 3) == -27.0f);
+        REQUIRE(power(2, -2) == 0.25f);
+        REQUIRE(power(7, 0) == 1.0f);
+        REQUIRE(power(0, -1) == std::numeric_limits<float>::infinity());
+    }
+    SECTION("Huge chains saturate without multiplying"){
+        REQUIRE(*evaluate("9^9^9^9") == std::numeric_limits<float>::infinity());
+        REQUIRE(*evaluate("-9^(9^9)") == -std::numeric_limits<float>::infinity());
+        REQUIRE(*evaluate("0.5^(9^9)") == 0.0f);
+        REQUIRE(power(-2, 1e9f) == std::numeric_limits<float>::infinity());
+    }
+    SECTION("Agrees with std::pow"){
+        for (float base : {-7.5f, -2.0f, -0.3f, 0.0f, 0.5f, 1.0f, 1.5f, 3.0f, 11.0f}) {
+            for (float exponent : {-40.0f, -3.0f, -0.5f, 0.0f, 0.25f, 1.0f, 2.0f, 7.0f, 33.0f, 200.0f}) {
+                CAPTURE(base, exponent);
+                const float expected = std::pow(base, exponent);
+                const float actual = power(base, exponent);
+                if (std::isnan(expected))
+                    REQUIRE(std::isnan(actual));
+                else if (expected == 0 || std::isinf(expected))
+                    REQUIRE(actual == expected);
+                else
+                    REQUIRE(std::fabs(actual - expected) <= 1e-6f * std::fabs(expected));
+            }
+        }
+    }
+    SECTION("Columns match the scalar kernel bit for bit"){
+        std::vector<float> bases;
+        std::vector<float> exponents;
+        for (int i = 0; i < 200; i++) {
+            bases.push_back(static_cast<float>(i % 23 - 11) * 0.75f);
+            // mostly small integers, with fractions, large values and NaN mixed in
+            exponents.push_back(i % 17 == 0 ? 0.5f : i % 29 == 0 ? 1000.0f : i == 101 ? NAN : static_cast<float>(i % 41 - 20));
+        }
+        std::vector<float> column(bases.size());
+        powColumn(bases.data(), exponents.data(), column.data(), bases.size());
+        for (std::size_t i = 0; i < bases.size(); i++) {
+            CAPTURE(bases[i], exponents[i]);
+            const float expected = power(bases[i], exponents[i]);
+            if (std::isnan(expected))
+                REQUIRE(std::isnan(column[i]));
+            else
+                REQUIRE(std::bit_cast<std::uint32_t>(column[i]) == std::bit_cast<std::uint32_t>(expected));
+        }
+    }
+}
+
+TEST_CASE("Parallel Evaluate", "[parallel]"){
+    using namespace psv;
+    SECTION("Splitting doesn't change values or errors"){
+        const std::vector<std::string> statements = {
+                "1 + 2 * 3 - 4 / 5", "(1 + 2) * 3 - -4 ^ 2", "-2 ^ 2 + 1", "-(2 + 3) ^ 2", "2 ^ 3 ^ 2",
+                "2 ^ -3 ^ 2", "8 / 4 / 2 - 1 - 1", "((((7 - 2))))", "(1 + 2) * (3 + 4) * (5 - 6)",
+                "-(3 * (2 + -(1 - 4)))", "1 / 0 + 2 / (1 - 1)", "1 - 4 / (2 - 2) * 3", "1 + 2..3 - 4",
+                "0.1 + 0.2 + 0.3 - 0.6", "3 * -2 ^ 2 / 7",
+        };
+        for (const auto &statement : statements) {
+            CAPTURE(statement);
+            Result<float> expected = evaluate(statement);
+            for (unsigned threads : {1u, 2u, 3u, 8u}) {
+                Result<float> actual = evaluateParallel(statement, threads, 1);
+                REQUIRE(actual.ok() == expected.ok());
+                if (expected.ok()) {
+                    REQUIRE(std::bit_cast<std::uint32_t>(*actual) == std::bit_cast<std::uint32_t>(*expected));
+                } else {
+                    REQUIRE(actual.error().code == expected.error().code);
+                    REQUIRE(actual.error().offset == expected.error().offset);
+                }
+            }
+        }
+    }
+    SECTION("Large statements"){
+        // a long sum of products and quotients of small parenthesized groups
+        std::string statement;
+        unsigned state = 7;
+        auto next = [&state](unsigned range) {
+            state = state * 1103515245 + 12345;
+            return (state >> 16) % range;
+        };
+        while (statement.size() < 4 * parallel_threshold) {
+            if (!statement.empty())
+                statement += "+-*/"[next(4)];
+            statement += "(" + std::to_string(next(9) + 1) + "+" + std::to_string(next(100)) + "/7)^" +
+                         std::to_string(next(3)) + "*" + std::to_string(next(50) + 1);
+        }
+        Result<float> sequential = evaluateParallel(statement, 1);
+        REQUIRE(sequential.ok());
+        Result<float> parallel = evaluateParallel(statement, 4);
+        REQUIRE(parallel.ok());
+        REQUIRE(std::bit_cast<std::uint32_t>(*parallel) == std::bit_cast<std::uint32_t>(*sequential));
+        // evaluate() hands statements this long over by itself
+        REQUIRE(std::bit_cast<std::uint32_t>(*evaluate(statement)) == std::bit_cast<std::uint32_t>(*sequential));
+        REQUIRE(steps.empty());
+
+        // the same, wrapped, so it has to be unwrapped before it can be split
+        const std::string wrapped = "-((" + statement + ")/(" + statement + "-1))";
+        sequential = evaluateParallel(wrapped, 1);
+        parallel = evaluateParallel(wrapped, 4);
+        REQUIRE(std::bit_cast<std::uint32_t>(*parallel) == std::bit_cast<std::uint32_t>(*sequential));
+
+        // a minus and a parenthesis per level, far deeper than one call per level could go
+        const std::size_t levels = 60001;
+        const std::string nested = [levels] {
+            std::string nested;
+            for (std::size_t i = 0; i < levels; i++)
+                nested += "-(";
+            return nested + "2" + std::string(levels, ')');
+        }();
+        REQUIRE(*evaluateParallel(nested, 4) == -2.0f);
+        REQUIRE(*evaluate(nested) == -2.0f);
+        REQUIRE(*evaluateParallel("1+" + nested + "*3", 4) == -5.0f);
+
+        // a split per level, each with one piece holding nearly all of it
+        for (std::size_t depth : {10000, 50000}) {
+            std::string lopsided;
+            for (std::size_t i = 0; i < depth; i++)
+                lopsided += "1+2*(";
+            lopsided += "1" + std::string(depth, ')');
+            sequential = evaluateParallel(lopsided, 1);
+            REQUIRE(sequential.ok());
+            parallel = evaluateParallel(lopsided, 4);
+            REQUIRE(std::bit_cast<std::uint32_t>(*parallel) == std::bit_cast<std::uint32_t>(*sequential));
+            REQUIRE(std::bit_cast<std::uint32_t>(*evaluatePrepared(lopsided, 4, 1024)) ==
+                    std::bit_cast<std::uint32_t>(*sequential));
+        }
+    }
+}
+
+TEST_CASE("Fast Math", "[fastMath]"){
+    using namespace psv;
+    SECTION("Same answers where the order can't matter"){
+        const std::vector<std::string> statements = {
+                "1 + 2 * 3 - 4 / 2", "(1 + 2) * 3 - -4 ^ 2", "-2 ^ 2 + 1", "-(2 + 3) ^ 2", "2 ^ 3 ^ 2",
+                "2 ^ -3 ^ 2", "8 / 4 / 2 - 1 - 1", "((((7 - 2))))", "2 * -3 ^ 2", "-(3 * (2 + -(1 - 4)))",
+                "1 / 0 + 2 / (1 - 1)", "1 - 4 / (2 - 2) * 3", "1 + 2..3 - 4", "1 / (0) ^ 1..2", "2 + 3 +",
+                "1" + std::string(50, '0') + " - 1", "0." + std::string(50, '0') + "1 + 1", ".5 + 5.",
+        };
+        for (const auto &statement : statements) {
+            CAPTURE(statement);
+            Result<float> expected = evaluate(statement);
+            Result<float> actual = evaluateFastMath(statement);
+            REQUIRE(actual.ok() == expected.ok());
+            if (expected.ok()) {
+                REQUIRE(*actual == *expected);
+            } else {
+                REQUIRE(actual.error().code == expected.error().code);
+                REQUIRE(actual.error().offset == expected.error().offset);
+            }
+        }
+    }
+    SECTION("Long sums stay accurate"){
+        // 0.1f is 0.100000001490116..., so 10000 of them are 1000.0000149...
+        std::string statement = "0.1";
+        for (int i = 1; i < 10000; i++)
+            statement += "+0.1";
+        const double exact = 10000.0 * 0.1f;
+        const double strict_error = std::fabs(*evaluateParallel(statement, 1) - exact);
+        const double fast_error = std::fabs(*evaluateFastMath(statement) - exact);
+        REQUIRE(fast_error <= std::nextafter(1000.0f, 2000.0f) - 1000.0f);
+        REQUIRE(fast_error * 100 < strict_error);
+    }
+    SECTION("Deep nesting"){
+        // Tens of thousands of levels, which used to be as many nested calls
+        const int depth = 40000;
+        std::string statement;
+        for (int i = 0; i < depth; i++)
+            statement += i % 3 == 0 ? "-(" : i % 3 == 1 ? "2^(" : "abs(1+";
+        statement += "1";
+        for (int i = 0; i < depth; i++)
+            statement += ")";
+        EvaluationContext context;
+        Result<float> expected = evaluate(statement, context);
+        Result<float> actual = evaluateFastMath(statement, context);
+        REQUIRE(expected.ok());
+        REQUIRE(actual.ok());
+        REQUIRE(*actual == *expected);
+        REQUIRE(evaluateFastMath(std::string(depth, '(') + "1/0" + std::string(depth, ')')).error().code ==
+                ErrorCode::ZeroDivision);
+    }
+    SECTION("Budgets"){
+        EvaluationContext context;
+        context.budget.max_depth = 3;
+        Result<float> deep = evaluateFastMath("((((1))))", context);
+        REQUIRE(deep.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Depth);
+        context.budget = {};
+        context.budget.max_reductions = 3;
+        REQUIRE(evaluateFastMath("1 + 2 * 3 - 4", context).ok());
+        Result<float> many = evaluateFastMath("1 + 2 * 3 - 4 / 5", context);
+        REQUIRE(many.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(many.error().offset == 14);
+        REQUIRE(context.meter.exceeded() == Limit::Reductions);
+        context.budget = {};
+        context.budget.max_magnitude = std::numeric_limits<float>::max();
+        Result<float> big = evaluateFastMath("1 / 2 + 10 ^ 50", context);
+        REQUIRE(big.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(big.error().offset == 11);
+        REQUIRE(context.meter.exceeded() == Limit::Magnitude);
+        CancellationToken token;
+        token.cancel();
+        context.budget = {};
+        context.budget.cancellation = &token;
+        REQUIRE(evaluateFastMath("1 + 1", context).error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Cancelled);
+    }
+    SECTION("Pairwise reduction"){
+        std::vector<double> terms(1000);
+        for (std::size_t i = 0; i < terms.size(); i++)
+            terms[i] = static_cast<double>(i + 1);
+        REQUIRE(pairwiseSum(terms.data(), terms.size()) == 500500.0);
+        REQUIRE(pairwiseSum(terms.data(), 3) == 6.0);
+        REQUIRE(pairwiseProduct(terms.data(), 10) == 3628800.0);
+        REQUIRE(pairwiseProduct(terms.data(), 0) == 1.0);
+    }
+}
+
+// Strict vs fast math on the same long chain: catch2's --benchmark-samples etc. apply
+TEST_CASE("Fast Math Benchmark", "[.][benchmark][fastMath]"){
+    using namespace psv;
+    std::string statement = "1.5";
+    for (int i = 1; i < 100000; i++)
+        statement += i % 3 == 0 ? "*1.0001+0.25" : "+0.75";
+    EvaluationContext context;
+    equation normalized;
+    std::vector<std::size_t> origin;
+    prepare(statement, normalized, origin);
+    BENCHMARK("strict"){
+        return evaluatePrepared(normalized, 1);
+    };
+    BENCHMARK("fast math"){
+        return evaluateFastMath(statement, context);
+    };
+}
+
+TEST_CASE("Definitions", "[definitions]"){
+    using namespace psv;
+    Definitions definitions;
+    REQUIRE(!definitions.define("a = 3*4"));
+    REQUIRE(!definitions.define("b = a^2 - 1"));
+    REQUIRE(!definitions.define("c = b/a"));
+    REQUIRE(definitions.update() == 3);
+    REQUIRE(*definitions.value("a") == 12.0f);
+    REQUIRE(*definitions.value("b") == 143.0f);
+    REQUIRE(*definitions.value("c") == *evaluate("143/12"));
+    REQUIRE(definitions.names() == std::vector<std::string>{"a", "b", "c"});
+
+    SECTION("Only what's downstream of an edit is recomputed"){
+        definitions.define("d = 7");
+        definitions.define("e = d + c");
+        REQUIRE(definitions.update() == 2);
+        definitions.define("b = a - 2");
+        REQUIRE(definitions.dirtyCount() == 3); // b, c and e
+        REQUIRE(definitions.update() == 3);
+        REQUIRE(*definitions.value("e") == 7.0f + 10.0f / 12.0f);
+        // the same expression again is not an edit
+        definitions.define("b", " a - 2");
+        REQUIRE(definitions.update() == 0);
+    }
+    SECTION("Names that aren't there"){
+        definitions.define("x = 2 * y + 1");
+        definitions.update();
+        REQUIRE(definitions.value("x").error().code == ErrorCode::UnknownName);
+        REQUIRE(definitions.value("x").error().offset == 5);
+        definitions.define("y = -1.5");
+        REQUIRE(definitions.update() == 2);
+        REQUIRE(*definitions.value("x") == -2.0f);
+        definitions.remove("y");
+        definitions.update();
+        REQUIRE(!definitions.contains("y"));
+        REQUIRE(definitions.value("x").error().code == ErrorCode::UnknownName);
+    }
+    SECTION("Errors"){
+        definitions.define("z = a / (b - 143)");
+        definitions.define("w = z + 1");
+        definitions.define("v = 2 +* a");
+        definitions.update();
+        REQUIRE(definitions.value("z").error().code == ErrorCode::ZeroDivision);
+        REQUIRE(definitions.value("z").error().offset == 3);
+        REQUIRE(definitions.value("w").error().code == ErrorCode::BadReference);
+        REQUIRE(definitions.value("w").error().offset == 1);
+        REQUIRE(definitions.value("v").error().code == ErrorCode::InvalidOperator);
+        REQUIRE(definitions.value("v").error().offset == 3);
+
+        definitions.define("p = q + 1");
+        definitions.define("q = r * 2");
+        definitions.define("r = p");
+        definitions.define("s = r - 1");
+        definitions.update();
+        for (const char *name : {"p", "q", "r", "s"})
+            REQUIRE(definitions.value(name).error().code == ErrorCode::CyclicDefinition);
+        definitions.define("r = 4");
+        definitions.update();
+        REQUIRE(*definitions.value("p") == 9.0f);
+        REQUIRE(*definitions.value("s") == 3.0f);
+
+        std::string name;
+        std::string expression;
+        REQUIRE(splitDefinition("3 * 4", name, expression).code == ErrorCode::InvalidDefinition);
+        REQUIRE(splitDefinition(" 2x = 1", name, expression).offset == 1);
+        REQUIRE(!splitDefinition(" speed_2 =3", name, expression));
+        REQUIRE(name == "speed_2");
+        REQUIRE(expression == "3");
+    }
+    SECTION("Values go through exactly"){
+        definitions.define("tenth = 0.1");
+        definitions.define("tiny = 0.5^140");
+        definitions.define("huge = 2^200");
+        definitions.define("negative = -3^3");
+        definitions.define("check = tenth * 3 + tiny * 2^70 * 2^70 - negative");
+        definitions.define("infinite = -huge");
+        definitions.update();
+        REQUIRE(*definitions.value("check") == *evaluate("0.1 * 3 + 1 - -27"));
+        REQUIRE(*definitions.value("tiny") > 0.0f);
+        REQUIRE(*definitions.value("infinite") == -std::numeric_limits<float>::infinity());
+    }
+    SECTION("Big independent waves are spread over threads"){
+        Definitions sequential;
+        Definitions parallel;
+        for (int i = 0; i < 1000; i++) {
+            const std::string line = "t" + std::to_string(i) + " = a * " + std::to_string(i) + " / 7 - 1";
+            sequential.define(line);
+            parallel.define(line);
+        }
+        sequential.define("a = 1.5");
+        parallel.define("a = 1.5");
+        REQUIRE(sequential.update(1) == 1001);
+        REQUIRE(parallel.update(4) == 1001);
+        for (int i = 0; i < 1000; i++) {
+            const std::string name = "t" + std::to_string(i);
+            REQUIRE(*parallel.value(name) == *sequential.value(name));
+        }
+    }
+    SECTION("Each definition stays within the budget"){
+        Budget budget;
+        budget.max_reductions = 3;
+        definitions.setBudget(budget);
+        REQUIRE(definitions.dirtyCount() == 3);
+        definitions.define("d = 1 + 2 + 3 + 4 + 5");
+        definitions.define("e = d * 2");
+        definitions.define("f = a + b + c");
+        REQUIRE(definitions.update() == 6);
+        REQUIRE(*definitions.value("b") == 143.0f);
+        Result<float> over = definitions.value("d");
+        REQUIRE(over.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(over.error().offset < definitions.expression("d").size());
+        REQUIRE(definitions.value("e").error().code == ErrorCode::BadReference);
+        REQUIRE(*definitions.value("f") == *evaluate("12 + 143 + 143/12"));
+
+        budget.max_depth = 2;
+        definitions.setBudget(budget);
+        definitions.define("g = ((a))");
+        definitions.update();
+        REQUIRE(definitions.value("g").error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(definitions.value("g").error().offset == 3);
+
+        definitions.setBudget({});
+        definitions.update();
+        REQUIRE(*definitions.value("e") == 30.0f);
+        REQUIRE(*definitions.value("g") == 12.0f);
+    }
+}
+
+TEST_CASE("Budgets", "[budget]"){
+    using namespace psv;
+    EvaluationContext context;
+    REQUIRE(*evaluate("2^(3*(4+5))", context) == 134217728.0f);
+
+    SECTION("Tokens and depth are checked before anything is evaluated"){
+        context.budget.max_tokens = 5;
+        REQUIRE(*evaluate("1 + 2 * 3", context) == 7.0f);
+        Result<float> result = evaluate("1 + 2 * 3 - 4", context);
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(result.error().offset == 10);
+        REQUIRE(context.meter.exceeded() == Limit::Tokens);
+        REQUIRE(context.steps.empty());
+
+        context.budget = {};
+        context.budget.max_depth = 2;
+        REQUIRE(*evaluate("((1))", context) == 1.0f);
+        result = evaluate("(1 + ((2)))", context);
+        REQUIRE(result.error().offset == 6);
+        REQUIRE(context.meter.exceeded() == Limit::Depth);
+    }
+    SECTION("Reductions"){
+        context.budget.max_reductions = 3;
+        REQUIRE(*evaluate("1 + 2 * 3 - 4", context) == 3.0f);
+        REQUIRE(context.steps.size() == 3);
+        Result<float> result = evaluate("-1 + 2 * 3 - 4", context);
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Reductions);
+        // budgets are per evaluation
+        REQUIRE(*evaluate("1 + 2 * 3 - 4", context) == 3.0f);
+    }
+    SECTION("Step memory"){
+        // well within the reductions the UI allows, but every step is most of 32 KB
+        std::string sum = "1";
+        while (sum.size() + 2 < parallel_threshold)
+            sum += "+1";
+        context.budget.max_reductions = 1 << 17;
+        context.budget.max_step_bytes = 1 << 20;
+        Result<float> result = evaluate(sum, context);
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::StepBytes);
+        std::size_t recorded = 0;
+        for (auto step : context.steps)
+            recorded += step.size();
+        REQUIRE(recorded <= context.budget.max_step_bytes);
+        REQUIRE(*evaluate("1 + 2 * 3 - 4", context) == 3.0f);
+    }
+    SECTION("Magnitude"){
+        context.budget.max_magnitude = std::numeric_limits<float>::max();
+        REQUIRE(*evaluate("2^127", context) == 0x1p127f);
+        Result<float> result = evaluate("1 + 9^9^9^9", context);
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(result.error().offset == 7);
+        REQUIRE(context.meter.exceeded() == Limit::Magnitude);
+        // only '^' is guarded
+        REQUIRE(*evaluate("2^127 * 4", context) == std::numeric_limits<float>::infinity());
+    }
+    SECTION("Deadline"){
+        context.budget.timeout = std::chrono::nanoseconds(1);
+        Result<float> result = evaluate("1 + 1", context);
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Deadline);
+    }
+    SECTION("Cancellation"){
+        CancellationToken token;
+        context.budget.cancellation = &token;
+        REQUIRE(*evaluate("1 + 1", context) == 2.0f);
+        std::thread([&token] { token.cancel(); }).join();
+        REQUIRE(evaluate("1 + 1", context).error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Cancelled);
+        token.reset();
+        REQUIRE(*evaluate("1 + 1", context) == 2.0f);
+
+        // Tripped while the evaluation is underway: thousands of steps, each
+        // copying the whole statement, take far longer than the canceller waits
+        std::string sum = "1";
+        for (int i = 0; i < 12000; i++)
+            sum += "+1";
+        std::thread canceller([&token] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            token.cancel();
+        });
+        const auto start = std::chrono::steady_clock::now();
+        Result<float> result = evaluate(sum, context);
+        canceller.join();
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Cancelled);
+        REQUIRE(context.steps.size() < 12000);
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    }
+    SECTION("Large statements on several threads"){
+        std::string sum = "1";
+        for (int i = 0; i < 40000; i++)
+            sum += "+1";
+        REQUIRE(sum.size() >= parallel_threshold);
+        REQUIRE(*evaluate(sum, context) == 40001.0f);
+        context.budget.max_reductions = 10000;
+        REQUIRE(evaluate(sum, context).error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(context.meter.exceeded() == Limit::Reductions);
+
+        Meter meter;
+        Budget budget;
+        budget.max_magnitude = 1e30f;
+        meter.start(budget);
+        Result<float> result = evaluatePrepared(sum + "+2^100", 4, 1024, &meter);
+        // the other threads stop wherever they'd got to, so the offset isn't the '^'
+        REQUIRE(result.error().code == ErrorCode::BudgetExceeded);
+        REQUIRE(meter.exceeded() == Limit::Magnitude);
+    }
+}
+
+TEST_CASE("Functions", "[functions]"){
+    using namespace psv;
+    REQUIRE(*evaluate("sqrt(16)") == 4.0f);
+    REQUIRE(*evaluate("sqrt (16) + abs(-3)") == 7.0f);
+    REQUIRE(*evaluate("max(1, 2) * min(3, 4)") == 6.0f);
+    REQUIRE(*evaluate("max(-1, -2)") == -1.0f);
+    REQUIRE(*evaluate("mod(7, 3) + mod(-7, 3)") == 0.0f);
+    REQUIRE(*evaluate("floor(-2.5) + floor(2.5)") == -1.0f);
+    REQUIRE(*evaluate("exp(0) + log(1) + sin(0) + cos(0)") == 2.0f);
+    REQUIRE(*evaluate("min(sqrt(16), max(2, 3)) + 1") == 4.0f);
+
+    SECTION("Precedence"){
+        // a call binds tighter than anything around it
+        REQUIRE(*evaluate("-sqrt(4)^2") == -4.0f);
+        REQUIRE(*evaluate("2^-sqrt(4)") == 0.25f);
+        REQUIRE(*evaluate("max(2, 3)^2") == 9.0f);
+        REQUIRE(*evaluate("1 + max(1 + 2*3, 4)*2") == 15.0f);
+        REQUIRE(*evaluate("max(-1, -sqrt(4))") == -1.0f);
+    }
+    SECTION("Errors"){
+        Result<float> result = evaluate("1 + max(1)");
+        REQUIRE(result.error().code == ErrorCode::InvalidCall);
+        REQUIRE(result.error().offset == 4);
+        REQUIRE(result.error().length == 6);
+        REQUIRE(evaluate("sqrt(1, 2)").error().code == ErrorCode::InvalidCall);
+        REQUIRE(evaluate("(1, 2)").error().offset == 2);
+        REQUIRE(evaluate("max(1,)").error().code == ErrorCode::InvalidCall);
+        REQUIRE(evaluate("sqrt()").error().code == ErrorCode::EmptyExpression);
+        REQUIRE(evaluate("2sqrt(4)").error().code == ErrorCode::MissingOperator);
+        result = evaluate("2 * mod(1, 0)");
+        REQUIRE(result.error().code == ErrorCode::ZeroDivision);
+        REQUIRE(result.error().offset == 4);
+        // only a known name followed by '(' is a call
+        REQUIRE(evaluate("sqrtx(4)").error().code == ErrorCode::InvalidCharacters);
+        REQUIRE(evaluate("sqrt").error().code == ErrorCode::InvalidCharacters);
+        REQUIRE(evaluate(std::string("1 + ") + first_opcode + "(4)").error().code == ErrorCode::InvalidCharacters);
+        REQUIRE(invalidCharacters("sqrt (4) + x").size() == 1);
+    }
+    SECTION("Steps"){
+        EvaluationContext context;
+        REQUIRE(*evaluate("1 + max(1 + 2*3, 4)*2", context) == 15.0f);
+        REQUIRE(context.steps.front() == "1+max(1+6,4)*2");
+        REQUIRE(context.steps[2] == "1+7*2");
+    }
+    SECTION("Kernels"){
+        // Within an ulp of the double-precision answer, and the column path agrees
+        // with the scalar one to the bit
+        auto close = [](float value, double exact) {
+            const float rounded = static_cast<float>(exact);
+            if (std::isnan(rounded) || std::isinf(rounded))
+                return std::isnan(rounded) ? std::isnan(value) : value == rounded;
+            return value == rounded || value == std::nextafter(rounded, value > rounded ? INFINITY : -INFINITY);
+        };
+        std::vector<float> inputs = {0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 1e-40f, 3.0e38f, -3.0e38f, 88.7f, -104.0f,
+                                     65536.0f, 1e6f, INFINITY, -INFINITY, NAN};
+        std::uint32_t seed = 1;
+        for (int i = 0; i < 20000; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            inputs.push_back(std::bit_cast<float>(seed));
+            inputs.push_back(static_cast<float>(seed >> 8) / (1 << 24) * 200 - 100);
+        }
+        std::size_t far = 0;
+        for (float x : inputs) {
+            far += !close(naturalLog(x), std::log(static_cast<double>(x)));
+            far += !close(exponential(x), std::exp(static_cast<double>(x)));
+            far += std::bit_cast<std::uint32_t>(floorOf(x)) != std::bit_cast<std::uint32_t>(std::floor(x));
+            if (std::fabs(x) <= trig_reduction_limit) {
+                far += !close(sine(x), std::sin(static_cast<double>(x)));
+                far += !close(cosine(x), std::cos(static_cast<double>(x)));
+            }
+        }
+        REQUIRE(far == 0);
+        std::vector<float> second(inputs.rbegin(), inputs.rend());
+        std::vector<float> out(inputs.size());
+        const float *columns[max_arity] = {inputs.data(), second.data()};
+        for (std::size_t f = 0; f < function_count; f++) {
+            functionColumn(static_cast<Function>(f), columns, out.data(), inputs.size());
+            std::size_t different = 0;
+            for (std::size_t i = 0; i < inputs.size(); i++) {
+                const float args[max_arity] = {inputs[i], second[i]};
+                different += std::bit_cast<std::uint32_t>(out[i]) != std::bit_cast<std::uint32_t>(functions[f].apply(args));
+            }
+            REQUIRE(different == 0);
+        }
+    }
+    SECTION("Every evaluator agrees"){
+        std::string statement = "0";
+        for (int i = 0; i < 3000; i++) {
+            statement += i % 3 == 0 ? "+max(" + std::to_string(i % 17) + ",-sqrt(" + std::to_string(i) + "))"
+                       : i % 3 == 1 ? "*mod(" + std::to_string(i) + ", 7)/floor(" + std::to_string(i % 5 + 1) + ".5)"
+                                    : "-sin(" + std::to_string(i) + ")^2";
+        }
+        const float expected = *evaluate(statement);
+        REQUIRE(*evaluateParallel(statement, 4, 256) == expected);
+        BatchCompiler batch;
+        batch.add(statement);
+        batch.add("mod(2, 1 - 1) + sqrt(4)");
+        std::vector<Result<float>> results = batch.evaluate();
+        REQUIRE(*results[0] == expected);
+        REQUIRE(results[1].error().code == ErrorCode::ZeroDivision);
+        REQUIRE(results[1].error().offset == 0);
+        REQUIRE(*evaluateFastMath("max(1, 2) * min(3, 4) - mod(7, 3)") == 5.0f);
+    }
+    SECTION("Definitions"){
+        Definitions definitions;
+        REQUIRE(!definitions.define("r = 3"));
+        REQUIRE(!definitions.define("area = floor(r^2 * 3.14159) + max(r, sqrt (r))"));
+        definitions.update();
+        REQUIRE(*definitions.value("area") == 31.0f);
+        REQUIRE(definitions.names().size() == 2);
+        REQUIRE(definitions.define("sqrt = 2").code == ErrorCode::InvalidDefinition);
+    }
+}
+
+TEST_CASE("C API", "[capi]"){
+    mm_context *context = mm_context_create();
+    REQUIRE(context != nullptr);
+    REQUIRE(mm_api_version() == MM_API_VERSION);
+    float value = 0;
+    mm_error error;
+    SECTION("Evaluate"){
+        REQUIRE(mm_evaluate(context, "2 * (3 + 4)", 11, &value, &error) == MM_OK);
+        REQUIRE(value == 14.0f);
+        REQUIRE(error.code == MM_OK);
+        REQUIRE(mm_step_count(context) == 0);
+        // only the first 5 bytes count
+        REQUIRE(mm_evaluate(context, "1 + 2garbage", 5, &value, nullptr) == MM_OK);
+        REQUIRE(value == 3.0f);
+        REQUIRE(mm_evaluate(context, "1 +  2 / 0", 10, &value, &error) == MM_ZERO_DIVISION);
+        REQUIRE(value == 3.0f);
+        REQUIRE(error.offset == 7);
+        REQUIRE(error.length == 1);
+        REQUIRE(std::string(mm_error_message(error.code)) == psv::errorMessage(psv::ErrorCode::ZeroDivision));
+        REQUIRE(mm_evaluate(context, "max(1)", 6, &value, &error) == MM_INVALID_CALL);
+        REQUIRE(mm_evaluate(context, "", 0, &value, &error) == MM_EMPTY_EXPRESSION);
+        REQUIRE(mm_evaluate(nullptr, "1", 1, &value, &error) == MM_INVALID_ARGUMENT);
+        REQUIRE(mm_evaluate(context, "1", 1, nullptr, &error) == MM_INVALID_ARGUMENT);
+        REQUIRE(std::string(mm_error_message(1000)).empty());
+        REQUIRE(!std::string(mm_error_message(MM_INTERNAL)).empty());
+    }
+    SECTION("Steps"){
+        mm_record_steps(context, 1);
+        REQUIRE(mm_evaluate(context, "2 * (3 + 4)", 11, &value, &error) == MM_OK);
+        REQUIRE(mm_step_count(context) == 2);
+        std::size_t length = 0;
+        const char *step = mm_step(context, 0, &length);
+        REQUIRE(std::string(step, length) == "2*(7)");
+        step = mm_step(context, 1, &length);
+        REQUIRE(std::string(step, length) == "14");
+        REQUIRE(mm_step(context, 2, &length) == nullptr);
+        mm_record_steps(context, 0);
+        REQUIRE(mm_evaluate(context, "1+1", 3, &value, &error) == MM_OK);
+        REQUIRE(mm_step_count(context) == 0);
+    }
+    SECTION("Compile"){
+        mm_program *program = mm_compile("sqrt(16) - -1", 13, &error);
+        REQUIRE(program != nullptr);
+        for (int i = 0; i < 3; i++) {
+            value = 0;
+            REQUIRE(mm_run(context, program, &value, &error) == MM_OK);
+            REQUIRE(value == 5.0f);
+        }
+        mm_program_free(program);
+        REQUIRE(mm_compile("1 + (2", 6, &error) == nullptr);
+        REQUIRE(error.code == MM_UNBALANCED_PARENTHESES);
+        program = mm_compile("4 / (2 - 2)", 11, &error);
+        REQUIRE(program != nullptr);
+        REQUIRE(mm_run(context, program, &value, &error) == MM_ZERO_DIVISION);
+        REQUIRE(error.offset == 2);
+        mm_program_free(program);
+    }
+    SECTION("Budgets"){
+        mm_budget budget{};
+        budget.max_depth = 2;
+        mm_set_budget(context, &budget);
+        REQUIRE(mm_evaluate(context, "(((1)))", 7, &value, &error) == MM_BUDGET_EXCEEDED);
+        REQUIRE(error.limit == MM_LIMIT_DEPTH);
+        REQUIRE(error.offset == 2);
+        budget = {};
+        mm_set_budget(context, &budget);
+        mm_cancel(context);
+        REQUIRE(mm_evaluate(context, "1+1", 3, &value, &error) == MM_BUDGET_EXCEEDED);
+        REQUIRE(error.limit == MM_LIMIT_CANCELLED);
+        mm_clear_cancel(context);
+        REQUIRE(mm_evaluate(context, "1+1", 3, &value, &error) == MM_OK);
+        REQUIRE(error.limit == MM_LIMIT_NONE);
+        budget.max_step_bytes = 8;
+        mm_set_budget(context, &budget);
+        mm_record_steps(context, 1);
+        REQUIRE(mm_evaluate(context, "1+2+3+4", 7, &value, &error) == MM_BUDGET_EXCEEDED);
+        REQUIRE(error.limit == MM_LIMIT_STEP_BYTES);
+        mm_record_steps(context, 0);
+        REQUIRE(mm_evaluate(context, "1+2+3+4", 7, &value, &error) == MM_OK);
+    }
+    SECTION("Batch"){
+        const char *statements[] = {"(1+2)*3", "4-(1+2)", "1/0", "min(2, 8)"};
+        float values[4];
+        mm_error errors[4];
+        REQUIRE(mm_evaluate_batch(context, statements, nullptr, 4, values, errors) == 1);
+        REQUIRE(values[0] == 9.0f);
+        REQUIRE(values[1] == 1.0f);
+        REQUIRE(std::isnan(values[2]));
+        REQUIRE(errors[2].code == MM_ZERO_DIVISION);
+        REQUIRE(errors[2].offset == 1);
+        REQUIRE(values[3] == 2.0f);
+        const std::size_t lengths[] = {5, 1};
+        REQUIRE(mm_evaluate_batch(context, statements, lengths, 2, values, nullptr) == 0);
+        REQUIRE(values[0] == 3.0f);
+        REQUIRE(values[1] == 4.0f);
+        REQUIRE(mm_evaluate_batch(context, nullptr, nullptr, 2, values, errors) == 2);
+        REQUIRE(errors[1].code == MM_INVALID_ARGUMENT);
+    }
+    mm_context_free(context);
+}
+
+// Shared with the workers, so a fault can be injected once rather than every time
+static std::atomic<int> *worker_kills = nullptr;
+
+TEST_CASE("Sharded Evaluate", "[sharded]"){
+    using namespace psv;
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "math_matters_sharded.txt";
+    std::vector<std::string> statements;
+    {
+        std::ofstream file(path, std::ios::binary);
+        for (int i = 0; i < 20000; i++) {
+            statements.push_back(i % 997 == 0 ? "" : i % 101 == 0 ? std::to_string(i) + " / (3 - 3)"
+                               : i % 89 == 0 ? std::to_string(i) + " / 0 + 1.2." + std::to_string(i % 5)
+                               : i % 83 == 0 ? std::to_string(i) + "..1 / (1 - 1)"
+                               : i % 13 == 0 ? "max(" + std::to_string(i) + ", 2^" + std::to_string(i % 9) + ")"
+                                             : std::to_string(i) + " * (1.5 - " + std::to_string(i % 7) + ") ^ 2");
+            file << statements.back() << (i + 1 < 20000 ? "\n" : "");
+        }
+    }
+    BatchCompiler batch;
+    for (auto const &statement : statements)
+        batch.add(statement);
+    const std::vector<Result<float>> expected = batch.evaluate();
+
+    std::vector<std::optional<Result<float>>> results;
+    std::size_t out_of_order = 0;
+    auto sink = [&](std::size_t line, const std::optional<Result<float>> &result) {
+        out_of_order += line != results.size();
+        results.push_back(result);
+    };
+    auto mismatches = [&]() {
+        std::size_t different = 0;
+        for (std::size_t i = 0; i < results.size(); i++) {
+            if (!results[i])
+                continue;
+            const Result<float> &result = *results[i];
+            different += result.ok() != expected[i].ok() ||
+                         (result.ok() && std::bit_cast<std::uint32_t>(*result) != std::bit_cast<std::uint32_t>(*expected[i])) ||
+                         result.error().code != expected[i].error().code || result.error().offset != expected[i].error().offset;
+        }
+        return different;
+    };
+    void *shared = mmap(nullptr, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(shared != MAP_FAILED);
+    worker_kills = new(shared) std::atomic<int>(0);
+    ShardOptions options;
+    options.workers = 4;
+    options.lines_per_task = 512;
+
+    SECTION("Same results, in order"){
+        ShardStats stats = evaluateSharded(path.string(), options, sink);
+        REQUIRE(stats.lines == 20000);
+        REQUIRE(stats.tasks == 40);
+        REQUIRE(stats.crashes == 0);
+        REQUIRE(results.size() == 20000);
+        REQUIRE(out_of_order == 0);
+        REQUIRE(mismatches() == 0);
+        REQUIRE(results[101]->error().code == ErrorCode::ZeroDivision);
+        REQUIRE(results[997]->error().code == ErrorCode::EmptyExpression);
+    }
+    SECTION("A dead worker's range is handed out again"){
+        options.before_line = [](std::size_t line) {
+            if (line == 5000 && worker_kills->fetch_add(1) == 0)
+                std::raise(SIGKILL);
+        };
+        ShardStats stats = evaluateSharded(path.string(), options, sink);
+        REQUIRE(stats.crashes == 1);
+        REQUIRE(stats.reassigned >= 1);
+        REQUIRE(results.size() == 20000);
+        REQUIRE(out_of_order == 0);
+        REQUIRE(std::count(results.begin(), results.end(), std::nullopt) == 0);
+        REQUIRE(mismatches() == 0);
+    }
+    SECTION("A line that always crashes is given up on"){
+        options.before_line = [](std::size_t line) {
+            if (line == 7000)
+                std::raise(SIGKILL);
+        };
+        options.max_attempts = 3;
+        ShardStats stats = evaluateSharded(path.string(), options, sink);
+        REQUIRE(stats.crashes == 3);
+        REQUIRE(results.size() == 20000);
+        REQUIRE(!results[7000]);
+        REQUIRE(std::count(results.begin(), results.end(), std::nullopt) == 1);
+        REQUIRE(mismatches() == 0);
+    }
+    SECTION("Small and missing files"){
+        options.workers = 0;
+        REQUIRE(evaluateSharded(path.string(), {.workers = 8, .lines_per_task = 100000}, sink).tasks == 1);
+        REQUIRE(mismatches() == 0);
+        REQUIRE_THROWS_AS(evaluateSharded((path.string() + ".missing"), options, sink), std::system_error);
+    }
+    munmap(shared, sizeof(std::atomic<int>));
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Result Store", "[store]"){
+    using namespace psv;
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "math_matters_results.store";
+    std::filesystem::remove(path);
+    auto normalize = [](const std::string &statement) {
+        equation normalized;
+        std::vector<std::size_t> origin;
+        REQUIRE(!prepare(statement, normalized, origin));
+        return normalized;
+    };
+    float value = 0;
+    std::string storage;
+    std::vector<std::string_view> steps;
+
+    SECTION("Values and steps come back, to any instance"){
+        EvaluationContext context;
+        const std::string statement = "2 * (3 + 4) - max(1, -2)^2";
+        const Result<float> result = evaluate(statement, context);
+        REQUIRE(result);
+        REQUIRE(context.steps.size() > 2);
+        {
+            ResultStore store(path.string());
+            REQUIRE(!store.find(normalize(statement)));
+            store.store(normalize(statement), statement, *result, &context.steps);
+        }
+        ResultStore store(path.string());
+        REQUIRE(store.find(normalize("2*(3+4)-max(1,-2)^2"), value, storage, steps));
+        REQUIRE(value == *result);
+        REQUIRE(steps == context.steps);
+        REQUIRE(store.find(normalize(statement)) == *result);
+        REQUIRE(store.stats().lookups == 3);
+        REQUIRE(store.stats().hits == 2);
+        REQUIRE(store.stats().stores == 1);
+    }
+    SECTION("Without steps, but never in place of them"){
+        ResultStore store(path.string());
+        store.store("1+1", "1 + 1", 2);
+        REQUIRE(store.find("1+1") == 2.0f);
+        REQUIRE(!store.find("1+1", value, storage, steps));
+        const std::vector<std::string_view> known = {"1+1", "2"};
+        store.store("1+1", "1+1", 2, &known);
+        store.store("1+1", "1 + 1", 2);
+        REQUIRE(store.find("1+1", value, storage, steps));
+        REQUIRE(steps == known);
+        const std::vector<std::string_view> none;
+        store.store("9", "9", 9, &none);
+        REQUIRE(store.find("9", value, storage, steps));
+        REQUIRE(steps.empty());
+        store.store("2^200", "2^200", std::numeric_limits<float>::infinity());
+        REQUIRE(!store.find("2^200"));
+    }
+    SECTION("Entering the same statement again stores nothing"){
+        ResultStore store(path.string(), {.slots = 1 << 12, .log_bytes = 64 * 1024});
+        store.store("0", "kept", 0);
+        const std::vector<std::string_view> known = {"2*3+1", "6+1", "7"};
+        store.store("2*3+1", "2 * 3 + 1", 7, &known);
+        const std::uint64_t version = store.version();
+        for (int i = 0; i < 20000; i++)
+            store.store("2*3+1", "2 * 3 + 1", 7, &known);
+        REQUIRE(store.version() == version);
+        REQUIRE(store.stats().stores == 2);
+        REQUIRE(store.find("0") == 0.0f);
+        REQUIRE(store.history(10).size() == 2);
+        // a different value is still news
+        store.store("2*3+1", "2 * 3 + 1", 8, &known);
+        REQUIRE(store.find("2*3+1") == 8.0f);
+    }
+    SECTION("History, newest first, once per statement"){
+        ResultStore store(path.string());
+        const std::uint64_t empty = store.version();
+        store.storeAll({{"1+2", "1 + 2", 3}, {"2*3", "2 * 3", 6}, {"4-1", "4 - 1", 3}});
+        store.store("1+2", "1+2", 3);
+        REQUIRE(store.version() != empty);
+        auto history = store.history(10);
+        REQUIRE(history.size() == 3);
+        REQUIRE(history[0].statement == "1+2");
+        REQUIRE(history[1].statement == "4 - 1");
+        REQUIRE(history[2].statement == "2 * 3");
+        REQUIRE(history[2].value == 6);
+        REQUIRE(history[2].time > 0);
+        REQUIRE(store.history(1).size() == 1);
+        auto found = store.findAll({"2*3", "5*5", "4-1"});
+        REQUIRE(found == std::vector<std::optional<float>>{6.0f, std::nullopt, 3.0f});
+    }
+    SECTION("Bounded: the oldest go first, and what's recalled stays"){
+        ResultStore store(path.string(), {.slots = 1 << 12, .log_bytes = 64 * 1024});
+        const auto size = std::filesystem::file_size(path);
+        store.store("0", "kept", 0);
+        for (int i = 1; i < 20000; i++) {
+            store.store(std::to_string(i) + "+0", std::to_string(i) + " + 0", static_cast<float>(i));
+            if (i % 100 == 0)
+                REQUIRE(store.find("0") == 0.0f);
+        }
+        REQUIRE(std::filesystem::file_size(path) == size);
+        REQUIRE(!store.find("1+0"));
+        REQUIRE(!store.find("15000+0"));
+        REQUIRE(store.find("19999+0") == 19999.0f);
+        REQUIRE(store.history(1)[0].statement == "19999 + 0");
+        REQUIRE(store.history(1000).size() < 1000);
+    }
+    SECTION("Processes store side by side"){
+        constexpr int children = 4;
+        constexpr int each = 500;
+        std::vector<pid_t> pids;
+        for (int child = 0; child < children; child++) {
+            pid_t pid = fork();
+            REQUIRE(pid >= 0);
+            if (pid == 0) {
+                ResultStore store(path.string());
+                for (int i = 0; i < each; i++) {
+                    const std::string key = std::to_string(child * each + i) + "*2";
+                    store.store(key, key, static_cast<float>((child * each + i) * 2));
+                    store.find(std::to_string(i) + "*2");
+                }
+                _exit(0);
+            }
+            pids.push_back(pid);
+        }
+        for (pid_t pid : pids) {
+            int status = 0;
+            REQUIRE(waitpid(pid, &status, 0) == pid);
+            REQUIRE(WIFEXITED(status));
+            REQUIRE(WEXITSTATUS(status) == 0);
+        }
+        ResultStore store(path.string());
+        int missing = 0;
+        for (int i = 0; i < children * each; i++)
+            missing += store.find(std::to_string(i) + "*2") != static_cast<float>(i * 2);
+        REQUIRE(missing == 0);
+        REQUIRE(store.stats().stores == children * each);
+        REQUIRE(store.history(10000).size() == children * each);
+    }
+    SECTION("Something else isn't taken for a store"){
+        std::ofstream(path) << "2 + 2\n";
+        REQUIRE_THROWS_AS(ResultStore(path.string()), std::system_error);
+        REQUIRE_THROWS_AS(ResultStore((path / "missing").string()), std::system_error);
+    }
+    std::filesystem::remove(path);
+}